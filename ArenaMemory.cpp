@@ -0,0 +1,158 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "ArenaMemory.hpp"
+
+namespace {
+
+// Default huge page size of x86-64 and arm64 with 4 KiB base pages
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+size_t roundUp(size_t bytes, size_t granule)
+{
+    return (bytes + granule - 1) / granule * granule;
+}
+
+// Huge pages need aligned memory, an anonymous mapping is only page
+// aligned. Maps a granule more and unmaps what sticks out.
+void* mapAligned(size_t bytes, size_t alignment)
+{
+    size_t padded = bytes + alignment;
+    char* raw = static_cast<char*>(mmap(0, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED) {
+        return 0;
+    }
+    char* aligned = reinterpret_cast<char*>(roundUp(reinterpret_cast<size_t>(raw), alignment));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + bytes, raw + padded - (aligned + bytes));
+    return aligned;
+}
+
+} // namespace
+
+
+/** ArenaMemory implementation **/
+
+size_t ArenaMemory::granule(size_t bytes) const
+{
+    if (obtained_.pages == ArenaOptions::PAGES_HUGETLB) {
+        return HUGE_PAGE_SIZE;
+    }
+    // Below one huge page there is nothing to gain from aligning
+    if (requested_.pages != ArenaOptions::PAGES_DEFAULT && bytes >= HUGE_PAGE_SIZE) {
+        return HUGE_PAGE_SIZE;
+    }
+    return sysconf(_SC_PAGESIZE);
+}
+
+void* ArenaMemory::map(size_t& bytes)
+{
+    obtained_ = requested_;
+    void* block = 0;
+    if (requested_.pages == ArenaOptions::PAGES_HUGETLB) {
+        size_t size = roundUp(bytes, HUGE_PAGE_SIZE);
+        block = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block == MAP_FAILED) {
+            block = 0;
+            obtained_.pages = ArenaOptions::PAGES_TRANSPARENT;
+        } else {
+            bytes = size;
+        }
+    }
+    if (block == 0) {
+        size_t alignment = granule(bytes);
+        bytes = roundUp(bytes, alignment);
+        block = mapAligned(bytes, alignment);
+        if (block == 0) {
+            return 0;
+        }
+        if (obtained_.pages == ArenaOptions::PAGES_TRANSPARENT && madvise(block, bytes, MADV_HUGEPAGE) != 0) {
+            obtained_.pages = ArenaOptions::PAGES_DEFAULT;
+        }
+    }
+
+    // Before the first touch, so every page is allocated on the node
+    if (requested_.numaNode >= 0) {
+        unsigned long nodeMask[16] = {};
+        const size_t bitsPerWord = 8 * sizeof(nodeMask[0]);
+        bool valid = static_cast<size_t>(requested_.numaNode) < bitsPerWord * 16;
+        if (valid) {
+            nodeMask[requested_.numaNode / bitsPerWord] = 1ul << (requested_.numaNode % bitsPerWord);
+        }
+        if (!valid || syscall(SYS_mbind, block, bytes, MPOL_BIND, nodeMask, bitsPerWord * 16, 0) != 0) {
+            obtained_.numaNode = -1;
+        }
+    }
+    return block;
+}
+
+void* ArenaMemory::reallocate(void* block, size_t oldBytes, size_t keepBytes, size_t& bytes)
+{
+    if (!mapped()) {
+        void* moved = realloc(block, bytes);
+        if (moved == 0) {
+            throw std::bad_alloc();
+        }
+        return moved;
+    }
+
+    // A mapping is rounded up to its pages, a block of the same size
+    // would change nothing
+    if (block != 0 && roundUp(bytes, granule(bytes)) == oldBytes) {
+        bytes = oldBytes;
+        return block;
+    }
+    void* moved = map(bytes);
+    if (moved == 0) {
+        throw std::bad_alloc();
+    }
+    if (block != 0) {
+        memcpy(moved, block, std::min(keepBytes, bytes));
+        release(block, oldBytes);
+    }
+    return moved;
+}
+
+void ArenaMemory::release(void* block, size_t bytes)
+{
+    if (block == 0) {
+        return;
+    }
+    if (mapped()) {
+        munmap(block, bytes);
+    } else {
+        free(block);
+    }
+}
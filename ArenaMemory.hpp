@@ -0,0 +1,87 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef ARENAMEMORY_HPP
+#define ARENAMEMORY_HPP
+
+#include <cstddef>
+
+/**
+ * Where the node arena of a container lives, see
+ * BasicIpContainer::setArena().
+ */
+struct ArenaOptions {
+    enum Pages {
+        // malloc() and realloc(), as the arena always came from
+        PAGES_DEFAULT,
+        // Anonymous mapping with MADV_HUGEPAGE, the kernel backs it with
+        // transparent huge pages when it has them to spare
+        PAGES_TRANSPARENT,
+        // MAP_HUGETLB from the reserved pool, PAGES_TRANSPARENT when the
+        // pool is empty
+        PAGES_HUGETLB
+    };
+
+    Pages pages;
+    // NUMA node the arena is bound to, -1 leaves placement to the thread
+    // that touches the pages first. Binding maps the arena even with
+    // PAGES_DEFAULT.
+    int numaNode;
+
+    ArenaOptions() : pages(PAGES_DEFAULT), numaNode(-1) {}
+    ArenaOptions(Pages pages_, int numaNode_ = -1) : pages(pages_), numaNode(numaNode_) {}
+};
+
+/**
+ * Memory backend of ChunkBuff. Blocks are moved as a whole on resize, so a
+ * mapping is never remapped piecewise and a binding covers all of it.
+ *
+ * Anything the system refuses falls back to the next best thing: huge pages
+ * to transparent ones, a binding to no binding. obtained() tells what the
+ * last block got.
+ */
+class ArenaMemory {
+public:
+    ArenaMemory() {}
+    explicit ArenaMemory(const ArenaOptions& options) : requested_(options), obtained_(options) {}
+
+    // Moves the first keepBytes of block (oldBytes long, null for none) to a
+    // block of at least bytes, which is updated to the usable size. Throws
+    // std::bad_alloc when there is no memory, block is left as it was.
+    void* reallocate(void* block, size_t oldBytes, size_t keepBytes, size_t& bytes);
+    void release(void* block, size_t bytes);
+
+    const ArenaOptions& requested() const { return requested_; }
+    const ArenaOptions& obtained() const { return obtained_; }
+
+private:
+    ArenaOptions requested_;
+    ArenaOptions obtained_;
+
+    bool mapped() const { return requested_.pages != ArenaOptions::PAGES_DEFAULT || requested_.numaNode >= 0; }
+    // Mappings of bytes are rounded up to this
+    size_t granule(size_t bytes) const;
+    void* map(size_t& bytes);
+};
+
+#endif /* ARENAMEMORY_HPP */
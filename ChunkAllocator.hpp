@@ -29,61 +29,428 @@
 #include <algorithm>
 #include <memory>
 #include <cassert>
+#include <cstring>
+#include <type_traits>
 
 #include <arpa/inet.h>
 
+#include "IpContainerStats.hpp"
+#include "ArenaMemory.hpp"
+
 
 const int MIN_CAPACITY = 8;
 
-template<class T, class UnderlyingPointerType>
+// Slot policies of ChunkBuff.
+// CompactingPolicy keeps the nodes dense: deallocate() moves the last node
+// into the hole and lets the owner fix the links to it (UpdateChunk).
+// FreeListPolicy never moves a node, freed slots are chained in a free list
+// and reused, so indices stay stable as long as the node lives.
+struct CompactingPolicy {};
+struct FreeListPolicy {};
+
+template<class T, class UnderlyingPointerType, class Policy>
 class ChunkAllocator;
 
+/**
+ * Slots of a ChunkBuff, in chunks of CHUNK_SLOTS reached through a directory
+ * by the high bits of the index.
+ *
+ * The first chunk grows by reallocation up to its full size. Past it whole
+ * chunks are added and removed, slots never move again, so growing copies
+ * at most one chunk and no add() waits for the whole arena to be copied.
+ * A chunk of IPv4 nodes is one 2 MiB huge page. Other node sizes may leave
+ * the arena rounding chunks up, they are released with the size it gave.
+ */
+template<class T, class I>
+class ChunkStorage {
+public:
+    typedef T value_type;
+    typedef I index_type;
+
+    static const int CHUNK_BITS = 17;
+    static const index_type CHUNK_SLOTS = static_cast<index_type>(1) << CHUNK_BITS;
+
+    ChunkStorage() : capacity_(0), firstBytes(0), chunkBytes(sizeof(value_type) * CHUNK_SLOTS) {
+        size_t bytes = sizeof(value_type) * MIN_CAPACITY;
+        chunks.push_back((value_type*)memory.reallocate(0, 0, 0, bytes));
+        firstBytes = bytes;
+        capacity_ = std::min<size_t>(bytes / sizeof(value_type), CHUNK_SLOTS);
+    }
+    ~ChunkStorage() {
+        release();
+    }
+
+    value_type& operator[](index_type index) { return chunks[index >> CHUNK_BITS][index & (CHUNK_SLOTS - 1)]; }
+    const value_type& operator[](index_type index) const { return chunks[index >> CHUNK_BITS][index & (CHUNK_SLOTS - 1)]; }
+    // 0 for attached slots, which are read-only
+    index_type capacity() const { return capacity_; }
+    // Capacity after one step of growth: doubled up to a chunk, then one
+    // chunk more
+    index_type grown() const { return capacity_ < CHUNK_SLOTS ? capacity_ * 2 : capacity_ + CHUNK_SLOTS; }
+
+    // Room for at least newCapacity slots, past the first chunk in whole
+    // chunks. The first used slots are kept.
+    void resize(index_type newCapacity, index_type used) {
+        index_type oldCapacity = capacity_;
+        if (newCapacity <= CHUNK_SLOTS) {
+            releaseChunks(1);
+            resizeFirst(newCapacity, used);
+        } else {
+            resizeFirst(CHUNK_SLOTS, used);
+            size_t count = (static_cast<size_t>(newCapacity) + CHUNK_SLOTS - 1) / CHUNK_SLOTS;
+            releaseChunks(count);
+            // Every chunk obtained is kept and counted, also when a later
+            // one fails
+            chunks.reserve(count);
+            while (chunks.size() < count) {
+                size_t bytes = sizeof(value_type) * CHUNK_SLOTS;
+                chunks.push_back((value_type*)memory.reallocate(0, 0, 0, bytes));
+                chunkBytes = bytes;
+                capacity_ = chunks.size() * CHUNK_SLOTS;
+            }
+            capacity_ = chunks.size() * CHUNK_SLOTS;
+        }
+        if (capacity_ != oldCapacity) {
+            IPCONTAINER_COUNT(reallocs, 1);
+        }
+    }
+
+    // Slots from first on that are contiguous in memory, at most count
+    const value_type* contiguous(index_type first, index_type& count) const {
+        count = std::min<index_type>(count, CHUNK_SLOTS - (first & (CHUNK_SLOTS - 1)));
+        return &(*this)[first];
+    }
+
+    // Serves n slots from memory owned by the caller, e.g. a mapped file
+    void attach(value_type* slots, index_type n) {
+        release();
+        chunks.clear();
+        for (size_t first = 0; first < n; first += CHUNK_SLOTS) {
+            chunks.push_back(slots + first);
+        }
+        capacity_ = 0;
+        firstBytes = 0;
+    }
+
+    // Moves the slots, the first used of them kept, to memory as options
+    // ask. Returns -1 for attached slots.
+    int setArena(const ArenaOptions& options, index_type used) {
+        if (capacity_ == 0) {
+            return -1;
+        }
+        // All of the new memory first, the slots stay where they are if
+        // any of it fails
+        ArenaMemory target(options);
+        std::vector<value_type*> moved;
+        std::vector<size_t> movedBytes;
+        moved.reserve(chunks.size());
+        movedBytes.reserve(chunks.size());
+        try {
+            for (size_t k = 0; k < chunks.size(); ++k) {
+                size_t bytes = sizeof(value_type) * (k == 0 ? std::min<size_t>(capacity_, CHUNK_SLOTS) : CHUNK_SLOTS);
+                moved.push_back((value_type*)target.reallocate(0, 0, 0, bytes));
+                movedBytes.push_back(bytes);
+            }
+        } catch (...) {
+            for (size_t k = 0; k < moved.size(); ++k) {
+                target.release(moved[k], movedBytes[k]);
+            }
+            throw;
+        }
+
+        // Slots move as bytes, as realloc() moves them: free ones hold a list
+        // link the copy constructor wouldn't keep, and none is destroyed
+        static_assert(std::is_trivially_destructible<value_type>::value, "Slots are moved without destroying them");
+        for (size_t k = 0; k < chunks.size(); ++k) {
+            size_t first = k * static_cast<size_t>(CHUNK_SLOTS);
+            size_t keep = used > first ? std::min<size_t>(used - first, CHUNK_SLOTS) : 0;
+            memcpy(static_cast<void*>(moved[k]), chunks[k], sizeof(value_type) * keep);
+            IPCONTAINER_COUNT(bytesMoved, sizeof(value_type) * keep);
+            memory.release(chunks[k], k == 0 ? firstBytes : chunkBytes);
+        }
+        chunks.swap(moved);
+        firstBytes = movedBytes[0];
+        chunkBytes = movedBytes.size() > 1 ? movedBytes[1] : sizeof(value_type) * CHUNK_SLOTS;
+        IPCONTAINER_COUNT(reallocs, 1);
+        memory = target;
+        return 0;
+    }
+    const ArenaMemory& arena() const { return memory; }
+
+    void swap(ChunkStorage& other) {
+        chunks.swap(other.chunks);
+        std::swap(capacity_, other.capacity_);
+        std::swap(firstBytes, other.firstBytes);
+        std::swap(chunkBytes, other.chunkBytes);
+        std::swap(memory, other.memory);
+    }
+
+#ifdef IPCONTAINER_STATS
+    void readStats(IpContainerStats& stats) const {
+        stats.reallocs = reallocs.get();
+        stats.bytesMoved = bytesMoved.get();
+    }
+#endif
+
+private:
+    std::vector<value_type*> chunks;
+    index_type capacity_;
+    // The first chunk is smaller until the arena outgrows it
+    size_t firstBytes;
+    // Size of each later chunk as the memory rounded it
+    size_t chunkBytes;
+    ArenaMemory memory;
+#ifdef IPCONTAINER_STATS
+    // Not exchanged by swap(), they count the owner's reallocations
+    StatCounter reallocs;
+    StatCounter bytesMoved;
+#endif
+
+    void resizeFirst(index_type newCapacity, index_type used) {
+        if (chunks.size() > 1 && newCapacity == CHUNK_SLOTS) {
+            return;
+        }
+        value_type* old = chunks[0];
+        size_t keep = sizeof(value_type) * std::min<size_t>(used, firstBytes / sizeof(value_type));
+        size_t bytes = sizeof(value_type) * newCapacity;
+        chunks[0] = (value_type*)memory.reallocate(old, firstBytes, keep, bytes);
+        if (chunks[0] != old) {
+            IPCONTAINER_COUNT(bytesMoved, std::min(keep, bytes));
+        }
+        firstBytes = bytes;
+        capacity_ = std::min<size_t>(bytes / sizeof(value_type), CHUNK_SLOTS);
+    }
+
+    // Keeps the first count chunks
+    void releaseChunks(size_t count) {
+        while (chunks.size() > count) {
+            memory.release(chunks.back(), chunkBytes);
+            chunks.pop_back();
+        }
+    }
+
+    void release() {
+        if (capacity_ == 0) {
+            return;
+        }
+        for (size_t k = 0; k < chunks.size(); ++k) {
+            memory.release(chunks[k], k == 0 ? firstBytes : chunkBytes);
+        }
+    }
+
+    ChunkStorage(const ChunkStorage&);
+    ChunkStorage& operator=(const ChunkStorage&);
+};
+
+template<class T, class I>
+const int ChunkStorage<T, I>::CHUNK_BITS;
 template<class T, class I>
+const I ChunkStorage<T, I>::CHUNK_SLOTS;
+
+template<class T, class I, class Policy = CompactingPolicy>
 class ChunkBuff {
 public:
     typedef T value_type;
     typedef I index_type;
 
     ChunkBuff() {
-        capacity = MIN_CAPACITY; 
         size = 1;
-        buf = (value_type*)malloc(sizeof(value_type) * capacity);
-    }
-    ~ChunkBuff() {
-        free(buf);
-        buf = 0;
-        capacity = 0;
-        size = 0;
     }
 
-    value_type& operator[](const index_type& index) { return buf[index]; }
+    value_type& operator[](const index_type& index) { return storage[index]; }
+    const value_type& operator[](const index_type& index) const { return storage[index]; }
+    const value_type* contiguous(index_type first, index_type& count) const { return storage.contiguous(first, count); }
+    index_type slots() const { return size; }
     index_type allocate() {
-        if (capacity <= size) {
-            capacity *= 2;
-            buf = (value_type*)realloc(buf, sizeof(value_type) * capacity);
+        assert(storage.capacity() != 0 && "Attached buffer is read-only");
+        if (storage.capacity() <= size) {
+            storage.resize(storage.grown(), size);
         }
-        assert(!capacity <= size);
-        ::new (&buf[size]) value_type();
+        assert(storage.capacity() > size);
+        ::new (&storage[size]) value_type();
         return size++;
     }
 
-    void deallocate(index_type index) {
+    template<class Owner>
+    void deallocate(index_type index, Owner& owner) {
+            assert(storage.capacity() != 0 && "Attached buffer is read-only");
             if (index != size - 1) {
-                buf[index] = buf[size - 1];
-                //TODO: Check if T has UpdateChunk method (SFINAE)
-                buf[index].UpdateChunk(index, size - 1);
+                storage[index] = storage[size - 1];
+                //TODO: Check if Owner has UpdateChunk method (SFINAE)
+                owner.UpdateChunk(index, size - 1);
             }
             size--;
+            index_type capacity = storage.capacity();
             if (capacity / 3 >= MIN_CAPACITY && size < capacity / 3) {
-                capacity /= 3;
-                buf = (value_type*)realloc(buf, sizeof(value_type) * capacity);
+                storage.resize(capacity / 3, size);
             }
     }
+
+    // Grows the buffer to hold n slots at once
+    void reserve(index_type n) {
+        if (storage.capacity() < n) {
+            storage.resize(n, size);
+        }
+    }
+
+    // Serves n slots from memory owned by the caller, e.g. a mapped file.
+    // The buffer is read-only from then on, capacity 0 marks it as foreign.
+    void attach(value_type* slots_, index_type n) {
+        storage.attach(slots_, n);
+        size = n;
+    }
+
+    // Moves the slots to memory as options ask. Returns -1 for an attached
+    // buffer.
+    int setArena(const ArenaOptions& options) { return storage.setArena(options, size); }
+    const ArenaMemory& arena() const { return storage.arena(); }
+
+    void swap(ChunkBuff& other) {
+        storage.swap(other.storage);
+        std::swap(size, other.size);
+    }
+
+#ifdef IPCONTAINER_STATS
+    void readStats(IpContainerStats& stats) const { storage.readStats(stats); }
+#endif
     
     private:
-        index_type capacity;
+        ChunkStorage<value_type, index_type> storage;
         index_type size;
-        value_type* buf; 
+
+        ChunkBuff(const ChunkBuff&);
+        ChunkBuff& operator=(const ChunkBuff&);
+};
+
+template<class T, class I>
+class ChunkBuff<T, I, FreeListPolicy> {
+public:
+    typedef T value_type;
+    typedef I index_type;
+
+    ChunkBuff() {
+        size = 1;
+        live = 0;
+        freeHead = 0;
+        trimBelow = storage.capacity() / 4;
+    }
+
+    value_type& operator[](const index_type& index) { return storage[index]; }
+    const value_type& operator[](const index_type& index) const { return storage[index]; }
+    const value_type* contiguous(index_type first, index_type& count) const { return storage.contiguous(first, count); }
+    index_type slots() const { return size; }
+    index_type allocate() {
+        assert(storage.capacity() != 0 && "Attached buffer is read-only");
+        index_type index;
+        if (freeHead != 0) {
+            index = freeHead;
+            freeHead = next(index);
+        } else {
+            if (storage.capacity() <= size) {
+                storage.resize(storage.grown(), size);
+                trimBelow = storage.capacity() / 4;
+            }
+            assert(storage.capacity() > size);
+            index = size++;
+        }
+        ::new (&storage[index]) value_type();
+        live++;
+        if (live / 2 > trimBelow) {
+            trimBelow = std::min(storage.capacity() / 4, live / 2);
+        }
+        return index;
+    }
+
+    template<class Owner>
+    void deallocate(index_type index, Owner&) {
+            assert(storage.capacity() != 0 && "Attached buffer is read-only");
+            assert(index > 0 && index < size);
+            next(index) = freeHead;
+            freeHead = index;
+            live--;
+            if (live < trimBelow || live == 0) {
+                trim();
+            }
+    }
+
+    void reserve(index_type n) {
+        if (storage.capacity() < n) {
+            storage.resize(n, size);
+        }
+    }
+
+    void attach(value_type* slots_, index_type n) {
+        storage.attach(slots_, n);
+        size = n;
+        live = n - 1;
+        freeHead = 0;
+        trimBelow = 0;
+    }
+
+    int setArena(const ArenaOptions& options) { return storage.setArena(options, size); }
+    const ArenaMemory& arena() const { return storage.arena(); }
+
+    void swap(ChunkBuff& other) {
+        storage.swap(other.storage);
+        std::swap(size, other.size);
+        std::swap(live, other.live);
+        std::swap(freeHead, other.freeHead);
+        std::swap(trimBelow, other.trimBelow);
+    }
+
+#ifdef IPCONTAINER_STATS
+    void readStats(IpContainerStats& stats) const { storage.readStats(stats); }
+#endif
+
+    private:
+        ChunkStorage<value_type, index_type> storage;
+        index_type size;
+        index_type live;
+        // Slot 0 is never handed out, so it terminates the free list
+        index_type freeHead;
+        index_type trimBelow;
+
+        index_type& next(index_type index) {
+            static_assert(sizeof(value_type) >= sizeof(index_type), "Slot can't hold a free list link");
+            return *reinterpret_cast<index_type*>(&storage[index]);
+        }
+
+        // Drops free slots from the tail and halves the buffer while it is
+        // at most a quarter full. Growing doubles at full, so a workload that
+        // oscillates around a boundary doesn't realloc on every operation.
+        void trim() {
+            std::vector<bool> isFree(size, false);
+            for (index_type i = freeHead; i != 0; i = next(i)) {
+                isFree[i] = true;
+            }
+            while (size > 1 && isFree[size - 1]) {
+                size--;
+            }
+            // Rebuild the list in address order, so low slots are reused
+            // first and the tail has a chance to become free
+            freeHead = 0;
+            for (index_type i = size; i-- > 1; ) {
+                if (isFree[i]) {
+                    next(i) = freeHead;
+                    freeHead = i;
+                }
+            }
+
+            index_type capacity = storage.capacity();
+            index_type newCapacity = capacity;
+            while (newCapacity / 2 >= MIN_CAPACITY && size <= newCapacity / 4) {
+                newCapacity /= 2;
+            }
+            if (newCapacity != capacity) {
+                storage.resize(newCapacity, size);
+            }
+            // A live node near the tail can pin the buffer; wait until the
+            // table halves again before the next scan
+            trimBelow = std::min(storage.capacity() / 4, live / 2);
+        }
+
+        ChunkBuff(const ChunkBuff&);
+        ChunkBuff& operator=(const ChunkBuff&);
 };
 
 
@@ -108,9 +475,6 @@ public:
 
     this_type& operator+=(difference_type rhs) {index += rhs; return *this;}
     this_type& operator-=(difference_type rhs) {index -= rhs; return *this;}
-    value_type& operator*() const {return MemoryAllocator::buf[index];}
-    value_type* operator->() const {return &MemoryAllocator::buf[index];}
-    value_type& operator[](difference_type rhs) const {return MemoryAllocator::buf[index + rhs];}
 
     this_type& operator++() {++index; return *this;}
     this_type& operator--() {--index; return *this;}
@@ -130,15 +494,15 @@ public:
     friend inline this_type operator+(difference_type lhs, const this_type& rhs) {return this_type(lhs + rhs.index);}
     friend inline this_type operator-(difference_type lhs, const this_type& rhs) {return this_type(lhs - rhs.index);}
     
-    friend class ChunkAllocator<value_type, underlying_pointer_type>;
-    friend class ChunkBuff<value_type, underlying_pointer_type>;
+    friend MemoryAllocator;
+    friend typename MemoryAllocator::buff_type;
 };
 
-template<class T, class UnderlyingPointerType = uint32_t>
+template<class T, class UnderlyingPointerType = uint32_t, class Policy = CompactingPolicy>
 class ChunkAllocator
 {
     public:
-        typedef ChunkAllocator<T, UnderlyingPointerType>  this_type;
+        typedef ChunkAllocator<T, UnderlyingPointerType, Policy>  this_type;
         typedef T                                         value_type;
         typedef UnderlyingPointerType                     underlying_pointer_type;
         typedef UnderlyingPointerType                     size_type;
@@ -148,10 +512,7 @@ class ChunkAllocator
         typedef T&                                        reference;
         typedef const T&                                  const_reference;
  
-        ChunkAllocator() throw() {}
-        ChunkAllocator(const this_type&) throw() {}
-        template <class U, class P = UnderlyingPointerType>
-        ChunkAllocator(const ChunkAllocator<U, P>&) throw() {}
+        ChunkAllocator() {}
         ~ChunkAllocator() throw() {}
 
         pointer address(reference x) const { return &x; }
@@ -162,28 +523,54 @@ class ChunkAllocator
             assert(n == 1);
             return buf.allocate();
         }
-        void deallocate(pointer p, size_type n) {
+        // owner gets UpdateChunk(newPointer, oldPointer) when a live slot
+        // is moved into the freed one
+        template<class Owner>
+        void deallocate(pointer p, size_type n, Owner& owner) {
             assert(n == 1);
             assert(p > 0);
-            buf.deallocate(p.index);
+            buf.deallocate(p.index, owner);
         }
         size_type max_size() const throw() { return 1; }
+        // Room for n slots, including the ones already allocated
+        void reserve(size_type n) { buf.reserve(n); }
+
+        // Raw slots for serialization, slot 0 is unused. Slots from first
+        // on that are contiguous in memory, count is cut to them.
+        const value_type* contiguous(size_type first, size_type& count) const { return buf.contiguous(first, count); }
+        size_type slots() const { return buf.slots(); }
+        void attach(value_type* slots_, size_type n) { buf.attach(slots_, n); }
+        // Exchanges the arenas, pointers follow the slots they point to
+        void swap(this_type& other) { buf.swap(other.buf); }
+        int setArena(const ArenaOptions& options) { return buf.setArena(options); }
+        const ArenaMemory& arena() const { return buf.arena(); }
+#ifdef IPCONTAINER_STATS
+        // Fills the arena counters of stats
+        void readStats(IpContainerStats& stats) const { buf.readStats(stats); }
+#endif
  
         void construct(pointer p, const T& val) { ::new (&buf[p.index]) T(val); }
         void destroy(pointer p) { buf[p.index].~T(); }
 
+        // Pointers only hold an index, they are resolved against the arena
+        // of the allocator that returned them
+        reference operator[](pointer p) { return buf[p.index]; }
+        const_reference operator[](pointer p) const { return buf[p.index]; }
+        // Slot of p, to check links read from a file before resolving them
+        static size_type indexOf(pointer p) { return p.index; }
+
         template <class U>
         struct rebind { typedef std::allocator<U> other; };
 
     private:
-        typedef ChunkBuff<value_type, size_type> buff_type;
-        static buff_type buf;
+        typedef ChunkBuff<value_type, size_type, Policy> buff_type;
+        buff_type buf;
+
+        ChunkAllocator(const this_type&);
+        this_type& operator=(const this_type&);
 
         friend class ChunkPointer<this_type>;
 };
 
-template<class T, class U>
-typename ChunkAllocator<T, U>::buff_type ChunkAllocator<T, U>::buf;
-
 
 #endif /* CHUNKALLOCATOR_HPP */
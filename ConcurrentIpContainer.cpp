@@ -0,0 +1,186 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <thread>
+#include <stdexcept>
+#include <new>
+#include <algorithm>
+#include <cstdlib>
+
+#include "ConcurrentIpContainer.hpp"
+
+
+/** ConcurrentIpContainer::Reader implementation **/
+
+ConcurrentIpContainer::Reader::Reader(ConcurrentIpContainer* owner_, ReaderSlot* slot_)
+    : owner(owner_)
+    , slot(slot_)
+{
+}
+
+ConcurrentIpContainer::Reader::Reader(Reader&& other)
+    : owner(other.owner)
+    , slot(other.slot)
+{
+    other.slot = 0;
+}
+
+ConcurrentIpContainer::Reader::~Reader()
+{
+    if (slot) {
+        slot->used.store(false, std::memory_order_release);
+    }
+}
+
+const IpSnapshot* ConcurrentIpContainer::Reader::enter()
+{
+    // The epoch store has to be visible before the snapshot is loaded,
+    // otherwise the writer could miss this reader in synchronize()
+    slot->epoch.store(owner->epoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+    return owner->current.load(std::memory_order_seq_cst);
+}
+
+void ConcurrentIpContainer::Reader::leave()
+{
+    slot->epoch.store(0, std::memory_order_release);
+}
+
+char ConcurrentIpContainer::Reader::check(uint32_t ip)
+{
+    char result = enter()->check(ip);
+    leave();
+    return result;
+}
+
+void ConcurrentIpContainer::Reader::checkBatch(const uint32_t* ips, char* out, size_t n)
+{
+    enter()->checkBatch(ips, out, n);
+    leave();
+}
+
+IpSnapshot::Kernel ConcurrentIpContainer::Reader::kernel()
+{
+    IpSnapshot::Kernel result = enter()->kernel();
+    leave();
+    return result;
+}
+
+
+/** ConcurrentIpContainer implementation **/
+
+ConcurrentIpContainer::ConcurrentIpContainer(size_t maxReaders)
+    : current(new IpSnapshot())
+    , spare(new IpSnapshot())
+    , epoch(1)
+    , slots(0)
+    , slotCount(maxReaders)
+{
+    static_assert(sizeof(ReaderSlot) == CACHE_LINE, "A reader slot fills one cache line");
+    void* raw = 0;
+    if (posix_memalign(&raw, CACHE_LINE, sizeof(ReaderSlot) * std::max<size_t>(slotCount, 1)) != 0) {
+        delete current.load();
+        delete spare;
+        throw std::bad_alloc();
+    }
+    slots = static_cast<ReaderSlot*>(raw);
+    for (size_t i = 0; i < slotCount; ++i) {
+        ::new (&slots[i]) ReaderSlot();
+    }
+}
+
+ConcurrentIpContainer::~ConcurrentIpContainer()
+{
+    for (size_t i = 0; i < slotCount; ++i) {
+        slots[i].~ReaderSlot();
+    }
+    free(slots);
+    delete current.load();
+    delete spare;
+}
+
+int ConcurrentIpContainer::add(unsigned int base, char mask)
+{
+    int ret = container.add(base, mask);
+    if (ret == 0) {
+        changes.push_back(std::make_pair(base, mask));
+    }
+    return ret;
+}
+
+int ConcurrentIpContainer::del(unsigned int base, char mask)
+{
+    int ret = container.del(base, mask);
+    if (ret == 0) {
+        changes.push_back(std::make_pair(base, mask));
+    }
+    return ret;
+}
+
+int ConcurrentIpContainer::apply(const UpdateBatch& batch)
+{
+    if (container.apply(batch) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < batch.updates.size(); ++i) {
+        changes.push_back(std::make_pair(batch.updates[i].base, batch.updates[i].mask));
+    }
+    publish();
+    return 0;
+}
+
+void ConcurrentIpContainer::publish()
+{
+    spareBehind.insert(spareBehind.end(), changes.begin(), changes.end());
+    spare->refresh(container, spareBehind);
+    spare = current.exchange(spare, std::memory_order_seq_cst);
+    synchronize(epoch.fetch_add(1, std::memory_order_seq_cst) + 1);
+
+    // The snapshot that just became spare has everything but this round
+    spareBehind.swap(changes);
+    changes.clear();
+}
+
+void ConcurrentIpContainer::synchronize(uint64_t epoch_)
+{
+    // Readers that entered before epoch_ may still use the old snapshot
+    for (size_t i = 0; i < slotCount; ++i) {
+        for (;;) {
+            uint64_t e = slots[i].epoch.load(std::memory_order_seq_cst);
+            if (e == 0 || e >= epoch_) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+ConcurrentIpContainer::Reader ConcurrentIpContainer::reader()
+{
+    for (size_t i = 0; i < slotCount; ++i) {
+        bool expected = false;
+        if (slots[i].used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return Reader(this, &slots[i]);
+        }
+    }
+    throw std::runtime_error("No free reader slot");
+}
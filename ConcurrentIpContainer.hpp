@@ -0,0 +1,118 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CONCURRENTIPCONTAINER_HPP
+#define CONCURRENTIPCONTAINER_HPP
+
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+#include "IpContainer.hpp"
+#include "IpSnapshot.hpp"
+
+/**
+ * IpContainer for one writer and many lock-free readers.
+ *
+ * The writer updates a private IpContainer and publish() brings the spare
+ * IpSnapshot up to date, refreshing only what changed since it was last
+ * current, and makes it current with a single atomic store.
+ * Readers only ever look at immutable snapshots. Every reader owns a slot in
+ * which it announces the epoch it entered in; a replaced snapshot is reused
+ * only after all readers that may still see it have left.
+ */
+class ConcurrentIpContainer {
+private:
+    static const size_t CACHE_LINE = 64;
+
+    // A cache line each, so readers don't share lines they write to. The
+    // slots are allocated aligned, std::vector wouldn't honour alignas.
+    struct alignas(CACHE_LINE) ReaderSlot {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> used;
+
+        ReaderSlot() : epoch(0), used(false) {}
+    };
+
+public:
+    class Reader {
+    public:
+        Reader(Reader&& other);
+        ~Reader();
+
+        char check(uint32_t ip);
+        // All addresses of one call are looked up in the same snapshot
+        void checkBatch(const uint32_t* ips, char* out, size_t n);
+        // Kernel checkBatch() runs on the current snapshot
+        IpSnapshot::Kernel kernel();
+
+    private:
+        ConcurrentIpContainer* owner;
+        ReaderSlot* slot;
+
+        Reader(ConcurrentIpContainer* owner, ReaderSlot* slot);
+        const IpSnapshot* enter();
+        void leave();
+
+        Reader(const Reader&);
+        Reader& operator=(const Reader&);
+
+        friend class ConcurrentIpContainer;
+    };
+
+    explicit ConcurrentIpContainer(size_t maxReaders = 64);
+    ~ConcurrentIpContainer();
+
+    // Writer side, changes become visible to readers after publish()
+    int add(unsigned int base, char mask);
+    int del(unsigned int base, char mask);
+    void publish();
+    // Applies the whole batch and publishes it, readers see all of it or
+    // none. Returns -1 and publishes nothing if the batch is invalid.
+    int apply(const UpdateBatch& batch);
+
+    // Throws std::runtime_error when all reader slots are taken
+    Reader reader();
+
+private:
+    IpContainer container;
+    std::atomic<IpSnapshot*> current;
+    IpSnapshot* spare;
+    typedef std::vector<std::pair<uint32_t, char> > change_list;
+    // Prefixes changed since the last publish(), and those the spare
+    // snapshot missed before that, they went into the current one only
+    change_list changes;
+    change_list spareBehind;
+    std::atomic<uint64_t> epoch;
+    ReaderSlot* slots;
+    size_t slotCount;
+
+    void synchronize(uint64_t epoch_);
+
+    ConcurrentIpContainer(const ConcurrentIpContainer&);
+    ConcurrentIpContainer& operator=(const ConcurrentIpContainer&);
+};
+
+#endif /* CONCURRENTIPCONTAINER_HPP */
@@ -24,343 +24,1116 @@
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "IpContainer.hpp"
 
 namespace {
 
-template<class T>
-void swap(T& v1, T& v2)
-{
-    T t = v1;
-    v1 = v2;
-    v2 = t;
-}
+const size_t BATCH_LANES = 16;
 
-} // namespace
+// File written by save(): the header, then the arena slots as they are in
+// memory. Pointers are slot indices, so the file works at any address.
+// Slot 1 is the root node.
+const char FILE_MAGIC[8] = {'I', 'P', 'C', 'O', 'N', 'T', 'N', 'R'};
+const uint32_t FILE_VERSION = 2;
+const uint32_t FILE_BYTE_ORDER = 0x01020304;
 
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t keyBits;
+    uint32_t nodeSize;
+    uint64_t nodeCount;
+};
 
-/** DataNode implementation **/
+// Keeps the slots that follow aligned for any key type
+static_assert(sizeof(FileHeader) == 32, "File header layout changed");
 
-bool DataNode::contain(char prefix)
+// Bit n of key, counting from the least significant one
+template<class Key>
+bool bitAt(Key key, int n)
 {
-    return std::binary_search(prefixes.begin(), prefixes.end(), prefix);
+    return (key >> n) & 1;
 }
 
-void DataNode::addPrefix(char prefix)
+// Whether every walk from the root of a mapped file stays inside its count
+// slots and ends in a leaf. Only what the root reaches is checked, free
+// slots of FreeListPolicy hold anything. Inner nodes branch on lower bits
+// than their parent, so no walk runs in circles, and a tree visits no node
+// twice, which bounds the pass.
+template<class Node>
+bool validLinks(const Node* nodes, uint64_t count, int bits)
 {
-    if (contain(prefix)) {
-        return;
+    typedef typename Node::node_allocator_type allocator_type;
+    typedef typename Node::node_pointer pointer;
+    // Nodes still to check, each with the bit its parent branches on
+    std::vector<std::pair<pointer, uint32_t> > pending;
+    if (nodes[1].root.child != pointer()) {
+        pending.push_back(std::make_pair(nodes[1].root.child, static_cast<uint32_t>(bits)));
     }
-
-    prefixes.push_back(prefix);
-    for (int i = prefixes.size() - 1; i > 0 ; --i) {
-        if (!(prefixes[i-1] < prefixes[i])) {
-            swap(prefixes[i-1], prefixes[i]);
+    uint64_t visited = 0;
+    while (!pending.empty()) {
+        uint64_t index = allocator_type::indexOf(pending.back().first);
+        uint32_t above = pending.back().second;
+        pending.pop_back();
+        if (index < 2 || index >= count || ++visited > count) {
+            return false;
+        }
+        const Node& node = nodes[index];
+        if (node.isLeaf()) {
+            continue;
+        }
+        if (!node.isInner() || node.inner.branchMask >= above) {
+            return false;
         }
-    }       
+        pending.push_back(std::make_pair(node.inner.one, node.inner.branchMask));
+        pending.push_back(std::make_pair(node.inner.zero, node.inner.branchMask));
+    }
+    return true;
 }
 
-int DataNode::removePrefix(char prefix)
+// Value runs of a leaf hold 2^class slots
+int runClass(int count)
 {
-    vector_type::iterator it = std::lower_bound(prefixes.begin(), prefixes.end(), prefix); 
-    if (it != prefixes.end() && !(prefix < *it)) { 
-        prefixes.erase(it);
-        return 0;
-    }
-    return -1;
+    return count <= 1 ? 0 : 32 - __builtin_clz(count - 1);
 }
 
-char DataNode::getMaxPrefixForIp(uint32_t ip_)
+template<class T>
+void swap(T& v1, T& v2)
 {
-    for (int i = prefixes.size() - 1; i >= 0; --i) {
-        uint32_t mask = static_cast<uint32_t>(-1) << (32 - prefixes[i]);
-        if ((ip & mask) == (ip_ & mask)) {
-            return prefixes[i];
-        }
-    }
-    return -1;
+    T t = v1;
+    v1 = v2;
+    v2 = t;
 }
 
+} // namespace
+
+
+/** BasicIpContainer implementation **/
+template<class P, class K>
+BasicIpContainer<P,K>::BasicIpContainer()
+    : BasicIpContainer(0)
+{
+}
 
-/** IpContainer implementation **/
-IpContainer::IpContainer()
+template<class P, class K>
+BasicIpContainer<P,K>::BasicIpContainer(size_t valueSize_)
+    : valueSize(valueSize_)
+    , valueStore(valueSize_)
 {
-    //XXX: Because root cannot be updated IpContainer should be singleton
+    // Root is the first node of the container's own arena. Compaction moves
+    // the last node into a hole, so root is never moved while other nodes live
     root = node_alloc.allocate(1);
     node_alloc.construct(root, node_type());
-    root->setRoot();
-    root->root.parent = pointer();
-    root->root.child = pointer();
+    at(root).setRoot();
+    at(root).root.child = pointer();
+    at(root).root.hasDefault = 0;
+    mapping = 0;
+    mappingSize = 0;
+    generationCount = 0;
 }
 
-IpContainer::~IpContainer()
+template<class P, class K>
+BasicIpContainer<P,K>::~BasicIpContainer()
 {
+    if (mapping != 0) {
+        munmap(mapping, mappingSize);
+        return;
+    }
     while (!empty()) {
         pointer p = findAny();
-        del(p->leaf.data->ip, *p->leaf.data->prefixes.rbegin());
+        del(at(p).leaf.data.ip, at(p).leaf.data.getMaxPrefix());
     }
 
     disconnectNode(root);
     deleteNode(root);
 }
 
-bool IpContainer::validate(unsigned int base, char mask)
+template<class P, class K>
+typename BasicIpContainer<P,K>::prefix_type BasicIpContainer<P,K>::getDefault() const
 {
-    bool v1 = mask >= 0 && mask <= 32 && base <= (1 << 31);
-    return v1 && ((base & (static_cast<uint32_t>(-1) >> mask)) == 0);
+    return at(root).root.hasDefault ? 0 : -1;
 }
-    
-char IpContainer::getDiffBit(uint32_t v1, uint32_t v2)
+
+template<class P, class K>
+bool BasicIpContainer<P,K>::validate(key_type base, prefix_type mask)
 {
-    char diffBit = 31;
-    while(((v1 ^ v2) & (static_cast<uint32_t>(1) << diffBit)) == 0) {
-        diffBit--;
-    }
+    bool v1 = mask >= 0 && mask <= traits_type::BITS;
+    return v1 && ((base & ~netmask<key_type>(mask)) == 0);
+}
     
-    return diffBit;
+template<class P, class K>
+char BasicIpContainer<P,K>::getDiffBit(key_type v1, key_type v2)
+{
+    assert(v1 != v2);
+    return traits_type::BITS - 1 - traits_type::clz(v1 ^ v2);
 }
 
-IpContainer::pointer IpContainer::createLeafNode(uint32_t ip, char mask)
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::createLeafNode(key_type ip, key_type prefixes)
 {
+    assert(prefixes != 0);
     pointer node = node_alloc.allocate(1);
     node_alloc.construct(node, node_type());
-    node->setLeaf();
-    node->leaf.data = data_alloc.allocate(1);
-    data_alloc.construct(node->leaf.data, data_type());
-    node->leaf.data->ip = ip;
-    node->leaf.data->addPrefix(mask);
-    node->leaf.parent = pointer();
+    at(node).setLeaf();
+    at(node).leaf.values = 0;
+    at(node).leaf.data.ip = ip;
+    at(node).leaf.data.prefixes = 0;
+    setPrefixes(node, prefixes);
     return node;
 }
 
-IpContainer::pointer IpContainer::createInnerNode()
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::createInnerNode()
 {
     pointer node = node_alloc.allocate(1);
     node_alloc.construct(node, node_type());
-    node->setInner();
-    node->inner.parent = pointer();
+    at(node).setInner();
     return node;
 }
     
-IpContainer::pointer IpContainer::createParentNode(pointer newNode, pointer siblingNode, char diffBit)
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::createParentNode(pointer newNode, pointer siblingNode, char diffBit)
 {
-    
     pointer oneNode = siblingNode;
     pointer zeroNode = newNode;
-    if (zeroNode->leaf.data->ip & (1 << diffBit)) {
+    if (bitAt(at(zeroNode).leaf.data.ip, diffBit)) {
         swap(zeroNode, oneNode);
     }
+    return joinNodes(zeroNode, oneNode, diffBit);
+}
 
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::joinNodes(pointer zeroNode, pointer oneNode, char diffBit)
+{
     pointer parent = createInnerNode();
-    parent->inner.zero = zeroNode;
-    parent->inner.one = oneNode;
-    parent->inner.branchMask = diffBit;
+    at(parent).inner.zero = zeroNode;
+    at(parent).inner.one = oneNode;
+    at(parent).inner.branchMask = diffBit;
+    at(parent).inner.cover = (getSubtreePrefixes(zeroNode) | getSubtreePrefixes(oneNode)) & prefixesUpTo<key_type>(traits_type::BITS - 1 - diffBit);
+    assert(!at(zeroNode).isLeaf() || !bitAt(at(zeroNode).leaf.data.ip, diffBit));
+    assert(!at(oneNode).isLeaf() || bitAt(at(oneNode).leaf.data.ip, diffBit));
+    return parent;
+}
 
-    if (zeroNode->isLeaf()) {
-        zeroNode->leaf.parent = parent;
-        assert((zeroNode->leaf.data->ip & (1 << diffBit)) == 0);
-    } else {
-        assert(zeroNode->isInner());
-        zeroNode->inner.parent = parent;
-    }
-    if (oneNode->isLeaf()) {
-        oneNode->leaf.parent = parent;
-        assert((oneNode->leaf.data->ip & (1 << diffBit)) != 0);
+template<class P, class K>
+void BasicIpContainer<P,K>::replaceChild(pointer parent, pointer oldChild, pointer newChild)
+{
+    if (at(parent).isRoot()) {
+        assert(at(parent).root.child == oldChild);
+        at(parent).root.child = newChild;
+    } else if (at(parent).inner.zero == oldChild) {
+        at(parent).inner.zero = newChild;
     } else {
-        assert(oneNode->isInner());
-        oneNode->inner.parent = parent;
+        assert(at(parent).inner.one == oldChild);
+        at(parent).inner.one = newChild;
     }
-    return parent;
 }
     
-void IpContainer::deleteNode(pointer node)
-{
-    assert(node->getParent() == pointer());
-    if (node->isLeaf()) {
-        data_alloc.destroy(node->leaf.data);
-        data_alloc.deallocate(node->leaf.data, 1);
-    } else if (node->isInner()) {
-        assert(node->inner.zero == pointer());
-        assert(node->inner.one == pointer());
-    } else {
-        assert(node->isRoot());
-        assert(node->root.child == pointer());
+template<class P, class K>
+void BasicIpContainer<P,K>::deleteNode(pointer node)
+{
+    if (at(node).isInner()) {
+        assert(at(node).inner.zero == pointer());
+        assert(at(node).inner.one == pointer());
+    } else if (at(node).isRoot()) {
+        assert(at(node).root.child == pointer());
     }
     node_alloc.destroy(node);
 
-    //NOTE: Local pointers that are greater than deallocate node can be invalid
-    node_alloc.deallocate(node, 1);
+    //NOTE: Local pointers that are greater than deallocate node can be invalid.
+    //      The node moved into the hole must be linked from the tree (see
+    //      UpdateChunk), so free disconnected nodes from the highest index.
+    node_alloc.deallocate(node, 1, *this);
 }
 
-void IpContainer::disconnectNode(pointer node)
+template<class P, class K>
+void BasicIpContainer<P,K>::UpdateChunk(pointer newPointer, pointer oldPointer)
 {
-    node_type& n = *node;
-    if (node->isInner()) {
-        node->inner.parent = pointer();
-        node->inner.zero = pointer();
-        node->inner.one = pointer();
-    } else if (node->isLeaf()) {
-        node->leaf.parent = pointer();
-    } else {
-        assert(node->isRoot());
-        assert(node->root.parent == pointer());
-        node->root.child = pointer();
+    assert(!at(newPointer).isRoot() && "Root can't be upated");
+    IPCONTAINER_COUNT(counters.chunkMoves, 1);
+
+    // Every walk to a leaf under the moved node passes the link to it
+    key_type ip = at(firstLeaf(newPointer)).leaf.data.ip;
+
+    pointer parent = root;
+    pointer node = at(root).root.child;
+    while (node != oldPointer) {
+        assert(at(node).isInner());
+        parent = node;
+        if (bitAt(ip, at(node).inner.branchMask)) {
+            node = at(node).inner.one;
+        } else {
+            node = at(node).inner.zero;
+        }
+    }
+    replaceChild(parent, oldPointer, newPointer);
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::disconnectNode(pointer node)
+{
+    if (at(node).isInner()) {
+        at(node).inner.zero = pointer();
+        at(node).inner.one = pointer();
+    } else if (at(node).isRoot()) {
+        at(node).root.child = pointer();
     }
 }
     
-IpContainer::pointer IpContainer::findNode(uint32_t ip) const
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::findNode(key_type ip) const
 {
-    pointer node = root->root.child;
+    pointer node = at(root).root.child;
     assert(node != pointer());
-    while (node->isInner()) {
-        if ((1 << node->inner.branchMask) & ip) {
-            node = node->inner.one;
+    while (at(node).isInner()) {
+        if (bitAt(ip, at(node).inner.branchMask)) {
+            node = at(node).inner.one;
         } else {
-            node = node->inner.zero;
+            node = at(node).inner.zero;
         }
     }
-    assert(node->isLeaf());
+    assert(at(node).isLeaf());
     return node;
 }
     
-IpContainer::pointer IpContainer::findAny() const
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::findNode(key_type ip, key_type& cover) const
+{
+    pointer node = at(root).root.child;
+    assert(node != pointer());
+    cover = 0;
+    int depth = 0;
+    while (at(node).isInner()) {
+        ++depth;
+        cover |= at(node).inner.cover;
+        if (bitAt(ip, at(node).inner.branchMask)) {
+            node = at(node).inner.one;
+        } else {
+            node = at(node).inner.zero;
+        }
+    }
+    assert(at(node).isLeaf());
+    countWalk(depth);
+    return node;
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::countLookup(prefix_type result) const
+{
+    IPCONTAINER_COUNT(counters.lookups, 1);
+    if (result == -1) {
+        IPCONTAINER_COUNT(counters.misses, 1);
+    } else {
+        IPCONTAINER_COUNT(counters.hits, 1);
+    }
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::countWalk(int depth) const
+{
+    IPCONTAINER_COUNT(counters.depths[depth], 1);
+    IPCONTAINER_COUNT(counters.lookupNodes, depth + 1);
+    (void)depth;
+}
+
+template<class P, class K>
+IpContainerStats BasicIpContainer<P,K>::stats() const
+{
+    IpContainerStats result;
+#ifdef IPCONTAINER_STATS
+    result.lookups = counters.lookups.get();
+    result.hits = counters.hits.get();
+    result.misses = counters.misses.get();
+    result.lookupNodes = counters.lookupNodes.get();
+    for (int d = 0; d <= IpContainerStats::MAX_DEPTH; ++d) {
+        result.depths[d] = counters.depths[d].get();
+    }
+    result.adds = counters.adds.get();
+    result.dels = counters.dels.get();
+    result.updateNodes = counters.updateNodes.get();
+    result.chunkMoves = counters.chunkMoves.get();
+    node_alloc.readStats(result);
+#endif
+    return result;
+}
+    
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::findAny() const
+{
+    pointer node = at(root).root.child;
+    while (at(node).isInner()) {
+            node = at(node).inner.one;
+    }
+    assert(at(node).isLeaf());
+    return node;
+}
+
+template<class P, class K>
+typename BasicIpContainer<P,K>::pointer BasicIpContainer<P,K>::firstLeaf(pointer node) const
 {
-    pointer node = root->root.child;
-    while (node->isInner()) {
-            node = node->inner.one;
+    while (at(node).isInner()) {
+        node = at(node).inner.zero;
     }
-    assert(node->isLeaf());
     return node;
 }
 
-bool IpContainer::empty() const
+template<class P, class K>
+bool BasicIpContainer<P,K>::empty() const
 {
-    return root->root.child == pointer();
+    return at(root).root.child == pointer();
 }
 
-int IpContainer::add(unsigned int base, char mask)
+template<class P, class K>
+typename BasicIpContainer<P,K>::key_type BasicIpContainer<P,K>::getSubtreePrefixes(pointer node) const
 {
-    if (!validate(base, mask)) {
+    if (at(node).isLeaf()) {
+        return at(node).leaf.data.prefixes;
+    }
+    assert(at(node).isInner());
+    return at(node).inner.cover;
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::updateCovers(const pointer* path, size_t depth)
+{
+    // A cover only depends on the children, so once one doesn't change
+    // the ones above don't either
+    while (depth-- > 0) {
+        pointer node = path[depth];
+        assert(at(node).isInner());
+        key_type cover = getSubtreePrefixes(at(node).inner.zero) | getSubtreePrefixes(at(node).inner.one);
+        cover &= prefixesUpTo<key_type>(traits_type::BITS - 1 - at(node).inner.branchMask);
+        if (cover == at(node).inner.cover) {
+            break;
+        }
+        at(node).inner.cover = cover;
+    }
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::save(const std::string& path) const
+{
+    // The file holds the arena only
+    if (valueSize != 0) {
         return -1;
     }
+    FileHeader header;
+    memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.byteOrder = FILE_BYTE_ORDER;
+    header.keyBits = traits_type::BITS;
+    header.nodeSize = sizeof(node_type);
+    header.nodeCount = node_alloc.slots();
 
-    if (root->root.child == pointer()) {
-        root->root.child = createLeafNode(base, mask);
-        root->root.child->leaf.parent = root;
-        return 0;
+    // Readers that mapped the old file keep it, the new one replaces it
+    // as a whole
+    std::string tmpPath = path + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (file == 0) {
+        return -1;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t first = 0; written && first < header.nodeCount; ) {
+        uint32_t count = header.nodeCount - first;
+        const node_type* slots = node_alloc.contiguous(first, count);
+        written = fwrite(slots, sizeof(node_type), count, file) == count;
+        first += count;
     }
+    if (fclose(file) != 0 || !written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return -1;
+    }
+    return 0;
+}
 
-    pointer node = findNode(base);
-    if (node->leaf.data->ip == base) {
-        node->leaf.data->addPrefix(mask);
+template<class P, class K>
+int BasicIpContainer<P,K>::open(const std::string& path)
+{
+    if (!empty() || mapping != 0 || at(root).root.hasDefault || valueSize != 0) {
+        return -1;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(FileHeader)) {
+        data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    const FileHeader& header = *static_cast<const FileHeader*>(data);
+    bool valid = memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == FILE_VERSION
+        && header.byteOrder == FILE_BYTE_ORDER
+        && header.keyBits == static_cast<uint32_t>(traits_type::BITS)
+        && header.nodeSize == sizeof(node_type)
+        && header.nodeCount >= 2
+        && header.nodeCount <= static_cast<uint32_t>(-1)
+        && header.nodeCount == (st.st_size - sizeof(FileHeader)) / sizeof(node_type)
+        && (st.st_size - sizeof(FileHeader)) % sizeof(node_type) == 0;
+    node_type* nodes = reinterpret_cast<node_type*>(static_cast<char*>(data) + sizeof(FileHeader));
+    if (!valid || !nodes[1].isRoot() || !validLinks(nodes, header.nodeCount, traits_type::BITS)) {
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    // The own root is dropped with the old buffer, the file has its own in
+    // the same slot
+    node_alloc.attach(nodes, header.nodeCount);
+    mapping = data;
+    mappingSize = st.st_size;
+    ++generationCount;
+    return 0;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::add(key_type base, prefix_type mask)
+{
+    if (mapping != 0 || !validate(base, mask)) {
+        return -1;
+    }
+
+    if (mask == 0) {
+        at(root).root.hasDefault = 1;
+        ++generationCount;
+        IPCONTAINER_COUNT(counters.adds, 1);
         return 0;
     }
-    
-    char diffBit = getDiffBit(node->leaf.data->ip, base);
 
-    if (node == root->root.child) {
-        node = createLeafNode(base, mask);
-        root->root.child = createParentNode(node, root->root.child, diffBit);   
-        root->root.child->inner.parent = root;
+    Walk walk;
+    insertPrefixes(base, static_cast<key_type>(1) << (mask - 1), walk);
+    IPCONTAINER_COUNT(counters.adds, 1);
+    return 0; 
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::walkTo(key_type base, Walk& walk) const
+{
+    size_t length = 1;
+    if (walk.length == 0) {
+        walk.nodes[0] = at(root).root.child;
+    } else {
+        // Above the first bit the two bases differ in they go the same way
+        key_type diff = walk.base ^ base;
+        int diffBit = diff == 0 ? -1 : traits_type::BITS - 1 - traits_type::clz(diff);
+        while (length < walk.length && static_cast<int>(at(walk.nodes[length - 1]).inner.branchMask) > diffBit) {
+            ++length;
+        }
+    }
+    pointer node = walk.nodes[length - 1];
+    while (at(node).isInner()) {
+        if (bitAt(base, at(node).inner.branchMask)) {
+            node = at(node).inner.one;
+        } else {
+            node = at(node).inner.zero;
+        }
+        walk.nodes[length++] = node;
+    }
+    assert(at(node).isLeaf());
+    walk.length = length;
+    walk.base = base;
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::insertPrefixes(key_type base, key_type prefixes, Walk& walk)
+{
+    assert(prefixes != 0);
+    ++generationCount;
+    if (at(root).root.child == pointer()) {
+        at(root).root.child = createLeafNode(base, prefixes);
+        walk.length = 0;
+        return;
+    }
+
+    // The closest base tells where the new one branches off, the nodes
+    // above that keep it and their covers may change
+    walkTo(base, walk);
+    pointer leaf = walk.nodes[walk.length - 1];
+    if (at(leaf).leaf.data.ip == base) {
+        setPrefixes(leaf, at(leaf).leaf.data.prefixes | prefixes);
+        updateCovers(walk.nodes, walk.length - 1);
+        IPCONTAINER_COUNT(counters.updateNodes, walk.length);
+        return;
+    }
+    char diffBit = getDiffBit(at(leaf).leaf.data.ip, base);
+    size_t depth = 0;
+    while (at(walk.nodes[depth]).isInner() && static_cast<int>(at(walk.nodes[depth]).inner.branchMask) > diffBit) {
+        ++depth;
+    }
+    pointer node = walk.nodes[depth];
+    pointer newLeafNode = createLeafNode(base, prefixes);
+    pointer newInnerNode = createParentNode(newLeafNode, node, diffBit);
+    replaceChild(depth > 0 ? walk.nodes[depth - 1] : root, node, newInnerNode);
+    updateCovers(walk.nodes, depth);
+    IPCONTAINER_COUNT(counters.updateNodes, depth + 1);
+
+    walk.nodes[depth] = newInnerNode;
+    walk.nodes[depth + 1] = newLeafNode;
+    walk.length = depth + 2;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::apply(const BasicUpdateBatch<K>& batch)
+{
+    typedef typename BasicUpdateBatch<K>::Update update_type;
+    if (mapping != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < batch.updates.size(); ++i) {
+        if (!validate(batch.updates[i].base, batch.updates[i].mask)) {
+            return -1;
+        }
+    }
+
+    // Sorting keeps updates of one route in batch order, the last one stays
+    std::vector<update_type> updates(batch.updates);
+    std::stable_sort(updates.begin(), updates.end());
+    size_t count = 0;
+    for (size_t i = 0; i < updates.size(); ++i) {
+        if (count > 0 && !(updates[count - 1] < updates[i])) {
+            updates[count - 1] = updates[i];
+        } else {
+            updates[count++] = updates[i];
+        }
+    }
+    updates.erase(updates.begin() + count, updates.end());
+
+    bool onlyAdds = true;
+    for (size_t i = 0; i < updates.size(); ++i) {
+        onlyAdds = onlyAdds && updates[i].add;
+    }
+    if (empty() && onlyAdds) {
+        std::vector<route_type> routes;
+        routes.reserve(updates.size());
+        for (size_t i = 0; i < updates.size(); ++i) {
+            routes.push_back(route_type(updates[i].base, updates[i].mask));
+        }
+        IPCONTAINER_COUNT(counters.adds, routes.size());
+        return buildTrie(routes);
+    }
+
+    // In address order neighbours share the top of their walks
+    Walk walk;
+    for (size_t i = 0; i < updates.size(); ) {
+        key_type base = updates[i].base;
+        key_type added = 0;
+        key_type removed = 0;
+        for (; i < updates.size() && updates[i].base == base; ++i) {
+            if (updates[i].mask == 0) {
+                // The default route has no leaf
+                if (updates[i].add) {
+                    add(0, 0);
+                } else {
+                    del(0, 0);
+                }
+            } else if (updates[i].add) {
+                added |= static_cast<key_type>(1) << (updates[i].mask - 1);
+                IPCONTAINER_COUNT(counters.adds, 1);
+            } else {
+                removed |= static_cast<key_type>(1) << (updates[i].mask - 1);
+                IPCONTAINER_COUNT(counters.dels, 1);
+            }
+        }
+        // Adding first keeps the leaf alive when the base also loses prefixes
+        if (added != 0) {
+            insertPrefixes(base, added, walk);
+        }
+        if (removed != 0) {
+            removePrefixes(base, removed, walk);
+        }
+    }
+    return 0;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::buildTrie(std::vector<route_type>& routes)
+{
+    if (mapping != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < routes.size(); ++i) {
+        if (!validate(routes[i].first, routes[i].second)) {
+            return -1;
+        }
+    }
+    if (!empty()) {
+        for (size_t i = 0; i < routes.size(); ++i) {
+            add(routes[i].first, routes[i].second);
+        }
         return 0;
     }
 
-    assert(root->root.child->isInner());
-    if (root->root.child->inner.branchMask < diffBit) {
-        node = createLeafNode(base, mask);
-        root->root.child = createParentNode(node, root->root.child, diffBit);
-        root->root.child->inner.parent = root;
+    ++generationCount;
+    if (!std::is_sorted(routes.begin(), routes.end())) {
+        std::sort(routes.begin(), routes.end());
+    }
+
+    // One leaf per distinct base, the default route lives in the root
+    std::vector<data_type> leaves;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        if (routes[i].second == 0) {
+            at(root).root.hasDefault = 1;
+            continue;
+        }
+        if (leaves.empty() || leaves.back().ip != routes[i].first) {
+            data_type data;
+            data.ip = routes[i].first;
+            data.prefixes = 0;
+            leaves.push_back(data);
+        }
+        leaves.back().addPrefix(routes[i].second);
+    }
+    if (leaves.empty()) {
         return 0;
     }
-    
-    pointer parentNode = node->leaf.parent;
-    while (parentNode->inner.branchMask < diffBit) {
-        node = parentNode;
-        parentNode = parentNode->inner.parent;
+
+    // In sorted order the trie is the Cartesian tree of the bits in which
+    // neighbouring bases differ, higher bits closer to the root. spine holds
+    // the left halves of the nodes on the right edge that still wait for
+    // their one side, so every node is created once with both children.
+    node_alloc.reserve(2 + 2 * leaves.size() - 1);
+    std::vector<std::pair<pointer, char> > spine;
+    pointer right = pointer();
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (i > 0) {
+            char diffBit = getDiffBit(leaves[i - 1].ip, leaves[i].ip);
+            while (!spine.empty() && spine.back().second < diffBit) {
+                right = joinNodes(spine.back().first, right, spine.back().second);
+                spine.pop_back();
+            }
+            spine.push_back(std::make_pair(right, diffBit));
+        }
+        right = createLeafNode(leaves[i].ip, leaves[i].prefixes);
     }
-    assert(parentNode->inner.branchMask > diffBit);
-    
-    pointer newLeafNode = createLeafNode(base, mask);
-    pointer newInnerNode = createParentNode(newLeafNode, node, diffBit);
-    newInnerNode->inner.parent = parentNode;
-    if (parentNode->inner.zero == node) {
-        parentNode->inner.zero = newInnerNode;
-    } else {
-        assert(parentNode->inner.one == node);
-        parentNode->inner.one = newInnerNode;
+    while (!spine.empty()) {
+        right = joinNodes(spine.back().first, right, spine.back().second);
+        spine.pop_back();
     }
-    return 0; 
+    at(root).root.child = right;
+    return 0;
 }
 
-char IpContainer::check(unsigned int ip)
+template<class P, class K>
+int BasicIpContainer<P,K>::getHeight(pointer node) const
 {
-    if (root->root.child == pointer()) {
-        return -1; 
+    if (!at(node).isInner()) {
+        return 1;
+    }
+    return 1 + std::max(getHeight(at(node).inner.zero), getHeight(at(node).inner.one));
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::collectLevel(pointer node, int depth, std::vector<pointer>& level) const
+{
+    if (depth == 0) {
+        level.push_back(node);
+    } else if (at(node).isInner()) {
+        collectLevel(at(node).inner.zero, depth - 1, level);
+        collectLevel(at(node).inner.one, depth - 1, level);
+    }
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::layoutSubtree(pointer node, int height, std::vector<pointer>& order) const
+{
+    // The top half goes first, then every subtree hanging below it, each
+    // laid out the same way
+    if (height == 1 || !at(node).isInner()) {
+        order.push_back(node);
+        return;
+    }
+    int top = height / 2;
+    layoutSubtree(node, top, order);
+    std::vector<pointer> bottom;
+    collectLevel(node, top, bottom);
+    for (size_t i = 0; i < bottom.size(); ++i) {
+        layoutSubtree(bottom[i], height - top, order);
+    }
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::relayout()
+{
+    if (mapping != 0) {
+        return -1;
+    }
+    std::vector<pointer> order;
+    if (!empty()) {
+        layoutSubtree(at(root).root.child, getHeight(at(root).root.child), order);
+    }
+
+    // Copy the nodes in the new order, leaving the new pointer in the old
+    // slot, then translate the child links through it
+    node_allocator_type nodes;
+    nodes.setArena(node_alloc.arena().requested());
+    nodes.reserve(order.size() + 2);
+    pointer newRoot = nodes.allocate(1);
+    nodes.construct(newRoot, at(root));
+    assert(newRoot == root);
+    std::vector<pointer> moved(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        moved[i] = nodes.allocate(1);
+        nodes.construct(moved[i], at(order[i]));
+        at(order[i]).inner.one = moved[i];
+    }
+    if (!order.empty()) {
+        nodes[newRoot].root.child = at(order[0]).inner.one;
+    }
+    for (size_t i = 0; i < moved.size(); ++i) {
+        node_type& node = nodes[moved[i]];
+        if (node.isInner()) {
+            node.inner.zero = at(node.inner.zero).inner.one;
+            node.inner.one = at(node.inner.one).inner.one;
+        }
+    }
+    node_alloc.swap(nodes);
+    return 0;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::setArena(const ArenaOptions& options)
+{
+    if (mapping != 0) {
+        return -1;
+    }
+    return node_alloc.setArena(options);
+}
+
+template<class P, class K>
+ArenaOptions BasicIpContainer<P,K>::arena() const
+{
+    return node_alloc.arena().obtained();
+}
+
+template<class P, class K>
+typename BasicIpContainer<P,K>::prefix_type BasicIpContainer<P,K>::check(key_type ip)
+{
+    if (at(root).root.child == pointer()) {
+        countLookup(getDefault());
+        return getDefault(); 
     } 
-    pointer node = findNode(ip);
-    return node->leaf.data->getMaxPrefixForIp(ip);
+    key_type cover;
+    pointer node = findNode(ip, cover);
+    prefix_type prefix = at(node).leaf.data.getMaxPrefixForIp(ip, cover);
+    prefix = prefix == -1 ? getDefault() : prefix;
+    countLookup(prefix);
+    return prefix;
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::checkBatch(const key_type* ips, prefix_type* out, size_t n)
+{
+    prefix_type defaultPrefix = getDefault();
+    if (at(root).root.child == pointer()) {
+        std::fill(out, out + n, defaultPrefix);
+        for (size_t i = 0; i < n; ++i) {
+            countLookup(defaultPrefix);
+        }
+        return;
+    }
+
+    // Every lane walks a different address. Lanes are advanced one level at
+    // a time and the next node is prefetched, so the misses of independent
+    // walks overlap. A lane that reaches a leaf stores its result and picks
+    // up a new address.
+    pointer lanes[BATCH_LANES];
+    size_t slots[BATCH_LANES];
+    key_type covers[BATCH_LANES];
+#ifdef IPCONTAINER_STATS
+    int depths[BATCH_LANES] = {};
+#endif
+    size_t next = 0;
+    size_t active = 0;
+    for (; active < BATCH_LANES && next < n; ++active, ++next) {
+        lanes[active] = at(root).root.child;
+        slots[active] = next;
+        covers[active] = 0;
+    }
+
+    while (active > 0) {
+        for (size_t l = 0; l < active; ) {
+            node_type& node = at(lanes[l]);
+            if (node.isInner()) {
+                covers[l] |= node.inner.cover;
+                if (bitAt(ips[slots[l]], node.inner.branchMask)) {
+                    lanes[l] = node.inner.one;
+                } else {
+                    lanes[l] = node.inner.zero;
+                }
+                __builtin_prefetch(&at(lanes[l]));
+#ifdef IPCONTAINER_STATS
+                ++depths[l];
+#endif
+                ++l;
+                continue;
+            }
+
+            assert(node.isLeaf());
+            prefix_type prefix = node.leaf.data.getMaxPrefixForIp(ips[slots[l]], covers[l]);
+            out[slots[l]] = prefix == -1 ? defaultPrefix : prefix;
+            countLookup(out[slots[l]]);
+#ifdef IPCONTAINER_STATS
+            countWalk(depths[l]);
+#endif
+            if (next < n) {
+                lanes[l] = at(root).root.child;
+                slots[l] = next++;
+                covers[l] = 0;
+#ifdef IPCONTAINER_STATS
+                depths[l] = 0;
+#endif
+                ++l;
+            } else {
+                --active;
+                lanes[l] = lanes[active];
+                slots[l] = slots[active];
+                covers[l] = covers[active];
+#ifdef IPCONTAINER_STATS
+                depths[l] = depths[active];
+#endif
+            }
+        }
+    }
 }
 
-int IpContainer::del(unsigned int base, char mask)
+template<class P, class K>
+bool BasicIpContainer<P,K>::resolve(key_type ip, int depth, pointer& node, key_type& cover, prefix_type& result) const
 {
-    if (root->root.child == pointer()) {
+    result = getDefault();
+    if (node == pointer()) {
+        return true;
+    }
+
+    // The walk goes on to a leaf even past a node that branches below depth:
+    // if that leaf differs from ip within depth, so does every base under
+    // the node, and only the covers matter
+    bool split = false;
+    pointer leaf = node;
+    key_type covering = cover;
+    while (at(leaf).isInner()) {
+        if (!split && at(leaf).inner.branchMask < traits_type::BITS - depth) {
+            split = true;
+            node = leaf;
+            cover = covering;
+        }
+        covering |= at(leaf).inner.cover;
+        if (bitAt(ip, at(leaf).inner.branchMask)) {
+            leaf = at(leaf).inner.one;
+        } else {
+            leaf = at(leaf).inner.zero;
+        }
+    }
+    if (!split) {
+        node = leaf;
+        cover = covering;
+    }
+
+    const data_type& data = at(leaf).leaf.data;
+    if (((data.ip ^ ip) & netmask<key_type>(depth)) == 0) {
+        if (split || (depth < traits_type::BITS && (data.prefixes >> depth) != 0)) {
+            // Some base shares all depth bits and has a longer prefix
+            return false;
+        }
+    }
+    prefix_type prefix = data.getMaxPrefixForIp(ip, covering);
+    if (prefix != -1) {
+        result = prefix;
+    }
+    return true;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::del(key_type base, prefix_type mask)
+{
+    if (mapping != 0) {
+        return -1;
+    }
+    if (mask == 0) {
+        if (base != 0 || !at(root).root.hasDefault) {
+            return -1;
+        }
+        at(root).root.hasDefault = 0;
+        std::fill(valueStore.begin(), valueStore.begin() + valueSize, 0);
+        ++generationCount;
+        IPCONTAINER_COUNT(counters.dels, 1);
+        return 0;
+    }
+    Walk walk;
+    if (mask < 0 || mask > traits_type::BITS || removePrefixes(base, static_cast<key_type>(1) << (mask - 1), walk) == -1) {
+        return -1;
+    }
+    IPCONTAINER_COUNT(counters.dels, 1);
+    return 0;
+}
+
+template<class P, class K>
+int BasicIpContainer<P,K>::removePrefixes(key_type base, key_type prefixes, Walk& walk)
+{
+    if (at(root).root.child == pointer()) {
         return -1; 
     } 
-    pointer node = findNode(base);
-    char ret = node->leaf.data->removePrefix(mask);
-    if (ret == -1) {
+
+    walkTo(base, walk);
+    pointer node = walk.nodes[walk.length - 1];
+    size_t depth = walk.length - 1;
+    if (at(node).leaf.data.ip != base) {
         return -1;
     }
-    if (!node->leaf.data->prefixes.empty()) {
+    if ((at(node).leaf.data.prefixes & prefixes) == 0) {
+        return -1;
+    }
+    setPrefixes(node, at(node).leaf.data.prefixes & ~prefixes);
+    ++generationCount;
+    IPCONTAINER_COUNT(counters.updateNodes, depth + 1);
+    if (!at(node).leaf.data.empty()) {
+        updateCovers(walk.nodes, depth);
         return 0;
     }
-    if (node == root->root.child) {
-        disconnectNode(root->root.child);
-
-        deleteNode(root->root.child);
-        root->root.child = pointer();
+    // Deleting may move other nodes (see CompactingPolicy)
+    walk.length = 0;
+    if (depth == 0) {
+        at(root).root.child = pointer();
+        deleteNode(node);
         return 0;
     }    
 
-    pointer child;
-    pointer oldParent = node->leaf.parent;
-    pointer newParent = oldParent->inner.parent;
-    if (oldParent->inner.zero == node) {
-        child = oldParent->inner.one;
-    } else {
-        assert(oldParent->inner.one == node);
-        child = oldParent->inner.zero;
+    // The sibling takes the place of the parent
+    pointer parent = walk.nodes[depth - 1];
+    pointer sibling = at(parent).inner.zero == node ? at(parent).inner.one : at(parent).inner.zero;
+    replaceChild(depth > 1 ? walk.nodes[depth - 2] : root, parent, sibling);
+    updateCovers(walk.nodes, depth - 1);
+
+    //XXX: Local pointers that are greater than deleted node can be invalid
+    if (node < parent) {
+        swap(node, parent);
     }
-    if (child->isLeaf()) {
-        child->leaf.parent = newParent;
-    } else {
-        child->inner.parent = newParent;
+
+    disconnectNode(node);
+    disconnectNode(parent);
+
+    deleteNode(node);
+    deleteNode(parent);
+    return 0;
+}
+
+template<class P, class K>
+void BasicIpContainer<P,K>::setPrefixes(pointer leaf, key_type prefixes)
+{
+    data_type& data = at(leaf).leaf.data;
+    if (valueSize == 0 || prefixes == data.prefixes) {
+        data.prefixes = prefixes;
+        return;
     }
-    if (!newParent->isRoot()) {
-        if (newParent->inner.zero == oldParent) {
-            newParent->inner.zero = child;
-        } else {
-            assert(newParent->inner.one == oldParent);
-            newParent->inner.one = child;
+
+    // Values go by rank, so the ones that stay may shift within the run.
+    // They are gathered first, the new run can be the old one.
+    int oldCount = traits_type::popcount(data.prefixes);
+    int newCount = traits_type::popcount(prefixes);
+    uint32_t first = at(leaf).leaf.values;
+    std::vector<char> moved(newCount * valueSize, 0);
+    data_type next = data;
+    next.prefixes = prefixes;
+    for (key_type kept = data.prefixes & prefixes; kept != 0; kept &= kept - 1) {
+        prefix_type prefix = traits_type::ctz(kept) + 1;
+        memcpy(&moved[next.rank(prefix) * valueSize], &valueStore[(first + data.rank(prefix)) * valueSize], valueSize);
+    }
+    if (oldCount == 0 || newCount == 0 || runClass(oldCount) != runClass(newCount)) {
+        if (oldCount != 0) {
+            freeRun(first, oldCount);
         }
-        assert(newParent->inner.one->getParent() == newParent);
-        assert(newParent->inner.zero->getParent() == newParent);
-    } else {
-        assert(newParent == root);
-        root->root.child = child;
-        assert(root->root.child->getParent() == root);
+        first = newCount != 0 ? allocateRun(newCount) : 0;
+        at(leaf).leaf.values = first;
     }
-    assert(child->getParent() == newParent);
+    if (newCount != 0) {
+        memcpy(&valueStore[first * valueSize], &moved[0], moved.size());
+    }
+    at(leaf).leaf.data.prefixes = prefixes;
+}
 
-    //XXX: Local pointers that are greater than deleted node can be invalid
-    if (node < oldParent) {
-        swap(node, oldParent);
+template<class P, class K>
+uint32_t BasicIpContainer<P,K>::allocateRun(int count)
+{
+    int size = runClass(count);
+    assert(size < VALUE_RUN_CLASSES);
+    if (!freeRuns[size].empty()) {
+        uint32_t first = freeRuns[size].back();
+        freeRuns[size].pop_back();
+        return first;
     }
+    uint32_t first = valueStore.size() / valueSize;
+    valueStore.resize(valueStore.size() + (static_cast<size_t>(1) << size) * valueSize);
+    return first;
+}
 
-    disconnectNode(node);
-    disconnectNode(oldParent);
+template<class P, class K>
+void BasicIpContainer<P,K>::freeRun(uint32_t first, int count)
+{
+    freeRuns[runClass(count)].push_back(first);
+}
 
-    deleteNode(node);
-    deleteNode(oldParent);
+template<class P, class K>
+char* BasicIpContainer<P,K>::valueOf(key_type base, prefix_type mask)
+{
+    if (valueSize == 0 || !validate(base, mask)) {
+        return 0;
+    }
+    if (mask == 0) {
+        return at(root).root.hasDefault ? &valueStore[0] : 0;
+    }
+    if (empty()) {
+        return 0;
+    }
+    pointer node = findNode(base);
+    const data_type& data = at(node).leaf.data;
+    if (data.ip != base || !data.contain(mask)) {
+        return 0;
+    }
+    return &valueStore[(at(node).leaf.values + data.rank(mask)) * valueSize];
 }
+
+template<class P, class K>
+typename BasicIpContainer<P,K>::prefix_type BasicIpContainer<P,K>::checkValue(key_type ip, const char*& value) const
+{
+    assert(valueSize != 0);
+    prefix_type prefix = getDefault();
+    value = prefix == 0 ? &valueStore[0] : 0;
+    if (!empty()) {
+        key_type cover;
+        pointer node = findNode(ip, cover);
+        prefix_type found = at(node).leaf.data.getMaxPrefixForIp(ip, cover);
+        if (found != -1) {
+            // A prefix from a cover is stored under another base
+            if (!at(node).leaf.data.contain(found) || !at(node).leaf.data.inside(ip, found)) {
+                node = findNode(ip & netmask<key_type>(found));
+            }
+            const data_type& data = at(node).leaf.data;
+            assert(data.contain(found) && data.inside(ip, found));
+            prefix = found;
+            value = &valueStore[(at(node).leaf.values + data.rank(found)) * valueSize];
+        }
+    }
+    countLookup(prefix);
+    return prefix;
+}
+
+template class BasicIpContainer<CompactingPolicy>;
+template class BasicIpContainer<FreeListPolicy>;
+template class BasicIpContainer<CompactingPolicy, uint64_t>;
+template class BasicIpContainer<FreeListPolicy, uint64_t>;
+template class BasicIpContainer<CompactingPolicy, unsigned __int128>;
+template class BasicIpContainer<FreeListPolicy, unsigned __int128>;
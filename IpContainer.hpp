@@ -25,24 +25,142 @@
 #define IPCONTAINER_HPP
 
 #include <vector>
+#include <string>
+#include <utility>
 #include <functional>
+#include <iterator>
+#include <cstddef>
 #include <cassert>
+#include <stdint.h>
 
 #include "ChunkAllocator.hpp"
+#include "IpContainerStats.hpp"
 
-struct DataNode
+/**
+ * Width specific parts of the trie. A key is an address as well as the
+ * prefix bitmap of a base, so it has to be an unsigned integer of BITS bits.
+ */
+template<class Key>
+struct KeyTraits;
+
+template<>
+struct KeyTraits<uint32_t> {
+    typedef char prefix_type;
+    static const int BITS = 32;
+
+    static int clz(uint32_t v) { return __builtin_clz(v); }
+    static int ctz(uint32_t v) { return __builtin_ctz(v); }
+    static int popcount(uint32_t v) { return __builtin_popcount(v); }
+};
+
+// A table id above an IPv4 address, see BasicMultiIpContainer
+template<>
+struct KeyTraits<uint64_t> {
+    typedef char prefix_type;
+    static const int BITS = 64;
+
+    static int clz(uint64_t v) { return __builtin_clzll(v); }
+    static int ctz(uint64_t v) { return __builtin_ctzll(v); }
+    static int popcount(uint64_t v) { return __builtin_popcountll(v); }
+};
+
+template<>
+struct KeyTraits<unsigned __int128> {
+    // /128 doesn't fit in a char
+    typedef short prefix_type;
+    static const int BITS = 128;
+
+    static int clz(unsigned __int128 v) {
+        uint64_t high = static_cast<uint64_t>(v >> 64);
+        return high != 0 ? __builtin_clzll(high) : 64 + __builtin_clzll(static_cast<uint64_t>(v));
+    }
+    static int ctz(unsigned __int128 v) {
+        uint64_t low = static_cast<uint64_t>(v);
+        return low != 0 ? __builtin_ctzll(low) : 64 + __builtin_ctzll(static_cast<uint64_t>(v >> 64));
+    }
+    static int popcount(unsigned __int128 v) {
+        return __builtin_popcountll(static_cast<uint64_t>(v)) + __builtin_popcountll(static_cast<uint64_t>(v >> 64));
+    }
+};
+
+template<int... N>
+struct IndexList {};
+
+template<int Count, int... N>
+struct MakeIndexList : MakeIndexList<Count - 1, Count - 1, N...> {};
+
+template<int... N>
+struct MakeIndexList<0, N...> {
+    typedef IndexList<N...> type;
+};
+
+template<class Key>
+constexpr Key makeNetmask(int mask)
+{
+    return mask == 0 ? 0 : static_cast<Key>(-1) << (KeyTraits<Key>::BITS - mask);
+}
+
+/**
+ * Netmasks /0 to /BITS, indexed by the mask length. Built at compile time,
+ * a lookup replaces the shift and the branch /0 needs.
+ */
+template<class Key, class List = typename MakeIndexList<KeyTraits<Key>::BITS + 1>::type>
+struct NetmaskTable;
+
+template<class Key, int... N>
+struct NetmaskTable<Key, IndexList<N...> > {
+    static constexpr Key masks[sizeof...(N)] = {makeNetmask<Key>(N)...};
+};
+
+template<class Key, int... N>
+constexpr Key NetmaskTable<Key, IndexList<N...> >::masks[sizeof...(N)];
+
+// Top mask bits of a key, mask = 0..BITS
+template<class Key>
+inline Key netmask(int mask)
+{
+    return NetmaskTable<Key>::masks[mask];
+}
+
+// Prefixes /1 to /length in BasicDataNode::prefixes format, length = 0..BITS
+template<class Key>
+inline Key prefixesUpTo(int length)
+{
+    return ~NetmaskTable<Key>::masks[KeyTraits<Key>::BITS - length];
+}
+
+template<class Key>
+struct BasicDataNode
 {
-    typedef std::vector<char> vector_type;
+    typedef Key                                   key_type;
+    typedef KeyTraits<Key>                        traits_type;
+    typedef typename traits_type::prefix_type     prefix_type;
 
-    uint32_t ip;
-    vector_type prefixes;
+    // Bit (n - 1) is set when prefix /n is stored, n = 1..BITS. The default
+    // route (/0) has no base of its own, it is kept in the root node.
+    key_type ip;
+    key_type prefixes;
 
-    bool contain(char prefix);
-    void addPrefix(char prefix);
-    int removePrefix(char prefix);
-    char getMaxPrefixForIp(uint32_t ip_);
+    bool empty() const;
+    bool contain(prefix_type prefix) const;
+    void addPrefix(prefix_type prefix);
+    int removePrefix(prefix_type prefix);
+    prefix_type getMaxPrefix() const;
+    // covering holds prefixes stored under other bases that share their
+    // leading bits with this one (see InnerNode::cover)
+    prefix_type getMaxPrefixForIp(key_type ip_, key_type covering = 0) const;
+    // Stored prefixes that contain ip_
+    key_type prefixesCovering(key_type ip_) const;
+    // Stored prefixes at least mask long
+    key_type prefixesFrom(prefix_type mask) const;
+    // Whether ip starts with the top mask bits of base
+    bool inside(key_type base, prefix_type mask) const;
+    // Number of stored prefixes shorter than prefix
+    int rank(prefix_type prefix) const;
 };
 
+typedef BasicDataNode<uint32_t> DataNode;
+
 template<class Pointer>
 struct RootNode {
     //TODO: Root node should contain pointer to variable that is used to tree access.
@@ -50,43 +168,48 @@ struct RootNode {
     typedef Pointer pointer;
 
     uint32_t flag;
-    pointer parent;
     pointer child;
+    uint32_t hasDefault;
 };
 
-template<class Pointer>
+template<class Pointer, class Key>
 struct InnerNode {
     typedef Pointer pointer;
 
     uint32_t branchMask;
-    pointer parent;
     pointer one;
     pointer zero;
+    // Prefixes stored in this subtree that are not longer than the bits all
+    // of its bases share (BITS - 1 - branchMask), in BasicDataNode::prefixes
+    // format.
+    // They cover every address whose walk passes this node and that shares
+    // that many leading bits with the leaf the walk ends in.
+    Key cover;
 };
 
-template<class NodePointer, class DataPointer>
+template<class NodePointer, class Data>
 struct LeafNode {
     typedef NodePointer node_pointer;
-    typedef DataPointer data_pointer;
+    typedef Data data_type;
 
     uint32_t     flag;
-    node_pointer parent;
-    data_pointer data;
+    // First slot of the values of this leaf's prefixes, see
+    // BasicIpContainer::valueStore. Fits in the padding after flag.
+    uint32_t     values;
+    data_type    data;
 };
 
-template<class NodePointer, class Data>
+template<class NodePointer, class Data, class Policy = CompactingPolicy>
 union Node {
     typedef Data                                   data_type;
-    typedef std::allocator<data_type>              data_allocator_type;
-    typedef typename data_allocator_type::pointer  data_pointer;
 
-    typedef Node<NodePointer, data_type>            node_type;
-    typedef ChunkAllocator<node_type, NodePointer>  node_allocator_type;
-    typedef typename node_allocator_type::pointer   node_pointer;
+    typedef Node<NodePointer, data_type, Policy>            node_type;
+    typedef ChunkAllocator<node_type, NodePointer, Policy>  node_allocator_type;
+    typedef typename node_allocator_type::pointer           node_pointer;
    
     struct RootNode<node_pointer>               root; 
-    struct InnerNode<node_pointer>              inner;
-    struct LeafNode<node_pointer, data_pointer> leaf;
+    struct InnerNode<node_pointer, typename data_type::key_type> inner;
+    struct LeafNode<node_pointer, data_type>    leaf;
 
     Node();
     Node(const node_type& node);
@@ -96,153 +219,598 @@ union Node {
     void setRoot();
     void setLeaf();
     void setInner();
-    node_pointer getParent() const;
-    void setParent(node_pointer node);
-
-    //ChunkAllocator concept
-    void UpdateChunk(node_pointer newPointer, node_pointer oldPointer);
 };
 
-class IpContainer {
+/**
+ * Adds and dels collected for BasicIpContainer::apply(). When a route is
+ * updated more than once, the last update wins.
+ */
+template<class Key = uint32_t>
+class BasicUpdateBatch {
 public:
-    typedef DataNode                                  data_type;
+    typedef Key                                       key_type;
+    typedef typename KeyTraits<Key>::prefix_type      prefix_type;
+
+    void add(key_type base, prefix_type mask) { updates.push_back(Update(base, mask, true)); }
+    void del(key_type base, prefix_type mask) { updates.push_back(Update(base, mask, false)); }
+    size_t size() const { return updates.size(); }
+    bool empty() const { return updates.empty(); }
+    void clear() { updates.clear(); }
+
+private:
+    struct Update {
+        key_type base;
+        prefix_type mask;
+        bool add;
+
+        Update(key_type base_, prefix_type mask_, bool add_) : base(base_), mask(mask_), add(add_) {}
+        bool operator<(const Update& other) const {
+            return base < other.base || (base == other.base && mask < other.mask);
+        }
+    };
+
+    std::vector<Update> updates;
 
-    IpContainer();
-    ~IpContainer();
-    int add(unsigned int base, char mask);
-    int del(unsigned int base, char mask);
-    char check(unsigned int ip);
+    template<class P, class K> friend class BasicIpContainer;
+    template<class P, class K> friend class BasicShardedIpContainer;
+    friend class ConcurrentIpContainer;
+};
+
+typedef BasicUpdateBatch<> UpdateBatch;
+
+/**
+ * Policy selects how the node arena reuses slots (see ChunkBuff). Key is
+ * the address type, uint32_t for IPv4 or unsigned __int128 for IPv6
+ * (uint64_t holds a table id as well, see BasicMultiIpContainer).
+ *
+ * Nodes don't link to their parents, which keeps an IPv4 node at 16 bytes.
+ * add() and del() collect the path on their way down instead.
+ */
+template<class Policy = CompactingPolicy, class Key = uint32_t>
+class BasicIpContainer {
+public:
+    typedef Key                                       key_type;
+    typedef BasicDataNode<Key>                        data_type;
+    typedef typename data_type::prefix_type           prefix_type;
+    typedef std::pair<key_type, prefix_type>          route_type;
+
+    class const_iterator;
+
+    BasicIpContainer();
+    ~BasicIpContainer();
+    int add(key_type base, prefix_type mask);
+    // Loads route_type pairs in one pass, without a walk per route. Sorted
+    // input isn't sorted again. A container that isn't empty falls back to
+    // add(). Returns -1 and changes nothing if any route is invalid.
+    template<class Iterator>
+    int bulkLoad(Iterator first, Iterator last);
+    int del(key_type base, prefix_type mask);
+    // Applies the updates of batch in address order, each base with a single
+    // walk that starts below the nodes it shares with the previous base. An
+    // empty container is built in one pass as by bulkLoad(). Dels of routes
+    // that aren't stored are skipped. Returns -1 and changes nothing if any
+    // update is invalid.
+    int apply(const BasicUpdateBatch<Key>& batch);
+    prefix_type check(key_type ip);
+    void checkBatch(const key_type* ips, prefix_type* out, size_t n);
+
+    // Writes the node arena to path in a versioned, position independent
+    // format. open() maps such a file into an empty container, which serves
+    // lookups from the shared pages right away and rejects updates. Both
+    // return -1 on failure.
+    int save(const std::string& path) const;
+    int open(const std::string& path);
+
+    // Renumbers the nodes in van Emde Boas order, so the top levels of every
+    // subtree share cache lines again after churn scattered them. Returns -1
+    // for a mapped container.
+    int relayout();
+
+    // Moves the node arena to huge pages or binds it to a NUMA node, and
+    // keeps it there as it grows. Lookups walk the arena at random, so huge
+    // pages spare most of their TLB misses. Returns -1 for a mapped
+    // container. arena() tells what the system granted.
+    int setArena(const ArenaOptions& options);
+    ArenaOptions arena() const;
+
+    // Call visitor(base, mask) for every stored prefix that contains ip,
+    // shortest first. Only subtrees that can hold such a prefix are entered.
+    template<class Visitor>
+    void forEachCovering(key_type ip, Visitor visitor) const;
+    // Call visitor(base, mask) for every stored prefix inside the network
+    // base/mask, itself included, ordered by base and then by mask. The walk
+    // goes straight to the subtree of the network.
+    template<class Visitor>
+    void forEachWithin(key_type base, prefix_type mask, Visitor visitor) const;
+
+    // Every stored route as (base, mask), ordered by base and then by mask.
+    // Any add(), del() or relayout() invalidates the iterators.
+    const_iterator begin() const;
+    const_iterator end() const;
+    // First route whose base is not below ip
+    const_iterator lower_bound(key_type ip) const;
+
+    // Copy of the counters compiled in with IPCONTAINER_STATS. Safe to call
+    // from another thread while the owner keeps working.
+    IpContainerStats stats() const;
+
+    // Changes whenever a route is added or removed, so results of check()
+    // can be cached for as long as it stays the same (see IpLookupCache)
+    uint64_t generation() const { return generationCount; }
 
 protected:
-    typedef Node<uint32_t, DataNode>                  node_type;
+    // Keeps valueSize bytes for every route, see BasicIpMap
+    explicit BasicIpContainer(size_t valueSize);
+
+    typedef typename data_type::traits_type           traits_type;
+    typedef Node<uint32_t, data_type, Policy>         node_type;
     typedef typename node_type::node_allocator_type   node_allocator_type;
-    typedef typename node_type::data_allocator_type   data_allocator_type;
     typedef typename node_allocator_type::pointer     pointer;
     typedef std::function<void(const pointer&)>       node_visitor_type;
     
     node_allocator_type node_alloc;
-    data_allocator_type data_alloc;
     pointer root;
-
-    bool validate(unsigned int base, char mask);
-    char getDiffBit(uint32_t v1, uint32_t v2);
-    pointer createLeafNode(uint32_t ip, char mask);
+    // File mapping that backs the arena after open()
+    void* mapping;
+    size_t mappingSize;
+    uint64_t generationCount;
+    // Values of the routes, valueSize bytes each, 0 for a plain container.
+    // A leaf keeps the values of its prefixes in prefix order, in a run of
+    // slots rounded up to a power of two so that most updates stay in place.
+    // Slot 0 is the default route's.
+    static const int VALUE_RUN_CLASSES = 8;
+    size_t valueSize;
+    std::vector<char> valueStore;
+    std::vector<uint32_t> freeRuns[VALUE_RUN_CLASSES];
+#ifdef IPCONTAINER_STATS
+    struct Counters {
+        StatCounter lookups;
+        StatCounter hits;
+        StatCounter misses;
+        StatCounter lookupNodes;
+        StatCounter depths[IpContainerStats::MAX_DEPTH + 1];
+        StatCounter adds;
+        StatCounter dels;
+        StatCounter updateNodes;
+        StatCounter chunkMoves;
+    };
+    mutable Counters counters;
+#endif
+
+    node_type& at(pointer node) { return node_alloc[node]; }
+    const node_type& at(pointer node) const { return node_alloc[node]; }
+
+    prefix_type getDefault() const;
+    bool validate(key_type base, prefix_type mask);
+    char getDiffBit(key_type v1, key_type v2);
+    pointer createLeafNode(key_type ip, key_type prefixes);
     pointer createInnerNode();
     pointer createParentNode(pointer newNode, pointer siblingNode, char diffBit);
+    pointer joinNodes(pointer zeroNode, pointer oneNode, char diffBit);
+    void replaceChild(pointer parent, pointer oldChild, pointer newChild);
+    // The nodes from the root's child down to the leaf one base leads to.
+    // apply() hands the walk of a base on to the next one, which keeps the
+    // nodes both pass and goes on from the deepest of them.
+    struct Walk {
+        Walk() : length(0) {}
+
+        pointer nodes[traits_type::BITS + 1];
+        size_t length;
+        key_type base;
+    };
+    // Brings walk down to the leaf of base, walk.length = 0 walks from the
+    // root's child
+    void walkTo(key_type base, Walk& walk) const;
+    // Store or remove several prefixes of one base (BasicDataNode::prefixes
+    // format) and leave walk at its leaf. removePrefixes() returns -1 if
+    // none of them was stored.
+    void insertPrefixes(key_type base, key_type prefixes, Walk& walk);
+    int removePrefixes(key_type base, key_type prefixes, Walk& walk);
+    // The only place a leaf's prefixes change, moves the values along.
+    // Prefixes that are new get zeroed values.
+    void setPrefixes(pointer leaf, key_type prefixes);
+    uint32_t allocateRun(int count);
+    void freeRun(uint32_t first, int count);
+    // Value of the stored route base/mask, 0 if there is none
+    char* valueOf(key_type base, prefix_type mask);
+    // check() that also finds the value of the match, 0 on a miss. A match
+    // the leaf at the end of the walk doesn't hold takes a second walk to
+    // its base.
+    prefix_type checkValue(key_type ip, const char*& value) const;
+    //ChunkAllocator concept
+    void UpdateChunk(pointer newPointer, pointer oldPointer);
     void deleteNode(pointer node);
     void disconnectNode(pointer node);
-    pointer findNode(uint32_t ip) const;
+    pointer findNode(key_type ip) const;
+    pointer findNode(key_type ip, key_type& cover) const;
+    // Counters of one lookup, no-ops without IPCONTAINER_STATS
+    void countLookup(prefix_type result) const;
+    void countWalk(int depth) const;
     pointer findAny() const;
+    // Leaf with the lowest base under node
+    pointer firstLeaf(pointer node) const;
     bool empty() const;
+    int buildTrie(std::vector<route_type>& routes);
+    int getHeight(pointer node) const;
+    void layoutSubtree(pointer node, int height, std::vector<pointer>& order) const;
+    void collectLevel(pointer node, int depth, std::vector<pointer>& level) const;
+    key_type getSubtreePrefixes(pointer node) const;
+    // path holds the inner nodes from the root down, deepest last
+    void updateCovers(const pointer* path, size_t depth);
+    template<class Visitor>
+    void visitSubtree(pointer node, prefix_type mask, Visitor& visitor) const;
+    template<class Visitor>
+    static void visitPrefixes(key_type base, key_type prefixes, Visitor& visitor);
+
+    // Walks from node using only the top `depth` bits of ip. Returns true and
+    // stores the result if check() gives the same answer for every address
+    // sharing those bits, otherwise stops at the node that needs more bits.
+    // cover accumulates InnerNode::cover of the nodes passed so far.
+    bool resolve(key_type ip, int depth, pointer& node, key_type& cover, prefix_type& result) const;
+
+    friend class IpSnapshot;
+    friend class ChunkBuff<node_type, uint32_t, Policy>;
 };
 
+/**
+ * Forward iterator over the routes of a BasicIpContainer.
+ *
+ * Nodes don't link to their parents, so the iterator keeps the one sides it
+ * still has to visit on a stack of its own. The stack is a fixed array, at
+ * most BITS deep, and every node is pushed once, so a step is O(1) amortized
+ * and no step allocates.
+ */
+template<class Policy, class Key>
+class BasicIpContainer<Policy, Key>::const_iterator {
+    typedef BasicIpContainer<Policy, Key>             container_type;
+    typedef typename container_type::pointer          node_pointer;
+public:
+    typedef std::forward_iterator_tag                 iterator_category;
+    typedef route_type                                value_type;
+    typedef std::ptrdiff_t                            difference_type;
+    typedef const route_type*                         pointer;
+    typedef const route_type&                         reference;
 
-/** Node implementation **/
+    const_iterator() : owner(0), depth(0), remaining(0) {}
 
-template<class N, class D>
-Node<N,D>::Node()
+    reference operator*() const { return current; }
+    pointer operator->() const { return &current; }
+    const_iterator& operator++();
+    const_iterator operator++(int) { const_iterator tmp(*this); ++*this; return tmp; }
+
+    bool operator==(const const_iterator& other) const {
+        return owner == other.owner && (owner == 0 || current == other.current);
+    }
+    bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+private:
+    const container_type* owner;
+    node_pointer pending[container_type::traits_type::BITS];
+    size_t depth;
+    // Prefixes of the current leaf that come after current
+    key_type remaining;
+    route_type current;
+
+    explicit const_iterator(const container_type* owner_) : owner(owner_), depth(0), remaining(0) {}
+    // Goes to the first leaf under node, or to the end for a null node
+    void enter(node_pointer node);
+
+    friend class BasicIpContainer<Policy, Key>;
+};
+
+typedef BasicIpContainer<> IpContainer;
+typedef BasicIpContainer<CompactingPolicy, unsigned __int128> Ip6Container;
+
+
+/** BasicIpContainer implementation **/
+
+template<class P, class K>
+template<class Iterator>
+int BasicIpContainer<P,K>::bulkLoad(Iterator first, Iterator last)
 {
-    setRoot();
+    std::vector<route_type> routes(first, last);
+    return buildTrie(routes);
 }
 
-template<class N, class D>
-Node<N,D>::Node(const node_type& node)
+template<class P, class K>
+typename BasicIpContainer<P,K>::const_iterator BasicIpContainer<P,K>::begin() const
 {
-    if (node.isLeaf()) {
-        leaf = node.leaf;
-    } else if (node.isRoot()) {
-        root = node.root;
-    } else {
-        inner = node.inner;
+    const_iterator it(this);
+    if (at(root).root.hasDefault) {
+        it.current = route_type(0, 0);
+        if (at(root).root.child != pointer()) {
+            it.pending[it.depth++] = at(root).root.child;
+        }
+        return it;
     }
+    it.enter(at(root).root.child);
+    return it;
 }
 
-template<class N, class D>
-bool Node<N,D>::isRoot() const {
-    return root.flag == static_cast<uint32_t>(-2);
+template<class P, class K>
+typename BasicIpContainer<P,K>::const_iterator BasicIpContainer<P,K>::end() const
+{
+    return const_iterator();
 }
 
-template<class N, class D>
-bool Node<N,D>::isLeaf() const {
-    return leaf.flag == static_cast<uint32_t>(-1);
+template<class P, class K>
+typename BasicIpContainer<P,K>::const_iterator BasicIpContainer<P,K>::lower_bound(key_type ip) const
+{
+    if (ip == 0 || at(root).root.child == pointer()) {
+        return ip == 0 ? begin() : end();
+    }
+
+    // The walk ends next to ip only if no skipped bit differs. The first
+    // differing bit of the leaf it reaches tells where ip really belongs.
+    pointer node = findNode(ip);
+    key_type diff = at(node).leaf.data.ip ^ ip;
+    int diffBit = diff == 0 ? -1 : traits_type::BITS - 1 - traits_type::clz(diff);
+
+    const_iterator it(this);
+    node = at(root).root.child;
+    while (at(node).isInner() && static_cast<int>(at(node).inner.branchMask) > diffBit) {
+        if ((ip >> at(node).inner.branchMask) & 1) {
+            node = at(node).inner.one;
+        } else {
+            it.pending[it.depth++] = at(node).inner.one;
+            node = at(node).inner.zero;
+        }
+    }
+    // All bases under node agree with each other on diffBit and differ
+    // from ip there, so they all come before or all after it
+    if (diffBit == -1 || !((ip >> diffBit) & 1)) {
+        it.enter(node);
+    } else if (it.depth > 0) {
+        it.enter(it.pending[--it.depth]);
+    } else {
+        it.owner = 0;
+    }
+    return it;
 }
 
-template<class N, class D>
-bool Node<N,D>::isInner() const {
-    return !isLeaf() && !isRoot();
+template<class P, class K>
+typename BasicIpContainer<P,K>::const_iterator& BasicIpContainer<P,K>::const_iterator::operator++()
+{
+    if (remaining != 0) {
+        current.second = static_cast<prefix_type>(traits_type::ctz(remaining) + 1);
+        remaining &= remaining - 1;
+    } else if (depth > 0) {
+        enter(pending[--depth]);
+    } else {
+        owner = 0;
+    }
+    return *this;
 }
 
-template<class N, class D>
-void Node<N,D>::setRoot() {
-    root.flag = static_cast<uint32_t>(-2);
+template<class P, class K>
+void BasicIpContainer<P,K>::const_iterator::enter(node_pointer node)
+{
+    if (node == node_pointer()) {
+        owner = 0;
+        return;
+    }
+    while (owner->at(node).isInner()) {
+        pending[depth++] = owner->at(node).inner.one;
+        __builtin_prefetch(&owner->at(pending[depth - 1]));
+        node = owner->at(node).inner.zero;
+    }
+    const data_type& data = owner->at(node).leaf.data;
+    current.first = data.ip;
+    current.second = static_cast<prefix_type>(traits_type::ctz(data.prefixes) + 1);
+    remaining = data.prefixes & (data.prefixes - 1);
 }
 
-template<class N, class D>
-void Node<N,D>::setLeaf() {
-    leaf.flag = static_cast<uint32_t>(-1);
+template<class P, class K>
+template<class Visitor>
+void BasicIpContainer<P,K>::forEachCovering(key_type ip, Visitor visitor) const
+{
+    if (at(root).root.hasDefault) {
+        visitor(static_cast<key_type>(0), static_cast<prefix_type>(0));
+    }
+    pointer node = at(root).root.child;
+    if (node == pointer()) {
+        return;
+    }
+
+    while (at(node).isInner()) {
+        const InnerNode<pointer, key_type>& inner = at(node).inner;
+        if (((ip >> inner.branchMask) & 1) == 0) {
+            node = inner.zero;
+            continue;
+        }
+        // A base that contains ip but branches off to the zero side is
+        // shorter than the bits shared above this node and ends in zeros.
+        // That makes it the first leaf there, and its prefix part of the
+        // cover of an inner zero node.
+        int shared = traits_type::BITS - 1 - inner.branchMask;
+        key_type shorter = (static_cast<key_type>(1) << shared) - 1;
+        if (!at(inner.zero).isInner() || (at(inner.zero).inner.cover & shorter) != 0) {
+            const data_type& data = at(firstLeaf(inner.zero)).leaf.data;
+            visitPrefixes(data.ip, data.prefixesCovering(ip) & shorter, visitor);
+        }
+        node = inner.one;
+    }
+    const data_type& data = at(node).leaf.data;
+    visitPrefixes(data.ip, data.prefixesCovering(ip), visitor);
 }
 
-template<class N, class D>
-void Node<N,D>::setInner() {
-    leaf.flag = 0;
+template<class P, class K>
+template<class Visitor>
+void BasicIpContainer<P,K>::forEachWithin(key_type base, prefix_type mask, Visitor visitor) const
+{
+    if (mask < 0 || mask > traits_type::BITS) {
+        return;
+    }
+    if (mask == 0 && at(root).root.hasDefault) {
+        visitor(static_cast<key_type>(0), static_cast<prefix_type>(0));
+    }
+    pointer node = at(root).root.child;
+    if (node == pointer()) {
+        return;
+    }
+
+    // Below a node that branches on bit mask or later, all bases share the
+    // top mask bits, so they are either all inside the network or none is
+    while (at(node).isInner() && traits_type::BITS - 1 - static_cast<int>(at(node).inner.branchMask) < mask) {
+        if ((base >> at(node).inner.branchMask) & 1) {
+            node = at(node).inner.one;
+        } else {
+            node = at(node).inner.zero;
+        }
+    }
+    if (at(firstLeaf(node)).leaf.data.inside(base, mask)) {
+        visitSubtree(node, mask, visitor);
+    }
 }
 
-template<class N, class D>
-typename Node<N,D>::node_pointer Node<N,D>::getParent() const
+template<class P, class K>
+template<class Visitor>
+void BasicIpContainer<P,K>::visitSubtree(pointer node, prefix_type mask, Visitor& visitor) const
 {
-    if (isLeaf()) {
-        return leaf.parent; 
-    } else if (isInner()) {
-        return inner.parent;
-    } else {
-        assert(isRoot());
-        return node_pointer();
+    if (at(node).isLeaf()) {
+        const data_type& data = at(node).leaf.data;
+        visitPrefixes(data.ip, data.prefixesFrom(mask), visitor);
+        return;
     }
+    visitSubtree(at(node).inner.zero, mask, visitor);
+    visitSubtree(at(node).inner.one, mask, visitor);
 }
 
-template<class N, class D>
-void Node<N,D>::setParent(node_pointer node)
+template<class P, class K>
+template<class Visitor>
+void BasicIpContainer<P,K>::visitPrefixes(key_type base, key_type prefixes, Visitor& visitor)
 {
-    if (isLeaf()) {
-        leaf.parent = node; 
-    } else {
-        assert(isInner()); 
-        inner.parent = node;
-    }   
+    while (prefixes != 0) {
+        int bit = traits_type::ctz(prefixes);
+        visitor(base, static_cast<prefix_type>(bit + 1));
+        prefixes &= prefixes - 1;
+    }
 }
 
-template<class N, class D>
-void Node<N,D>::UpdateChunk(node_pointer newPointer, node_pointer oldPointer)
+
+/** BasicDataNode implementation **/
+
+template<class K>
+bool BasicDataNode<K>::empty() const
 {
-    assert(!isRoot() && "Root can't be upated");
+    return prefixes == 0;
+}
 
-    node_pointer node = getParent();
-    if (node == node_pointer()) {
-        //this node is disconnected or it is root
-        return;
+template<class K>
+bool BasicDataNode<K>::contain(prefix_type prefix) const
+{
+    return (prefixes >> (prefix - 1)) & 1;
+}
+
+template<class K>
+void BasicDataNode<K>::addPrefix(prefix_type prefix)
+{
+    assert(prefix > 0 && prefix <= traits_type::BITS);
+    prefixes |= static_cast<key_type>(1) << (prefix - 1);
+}
+
+template<class K>
+int BasicDataNode<K>::removePrefix(prefix_type prefix)
+{
+    if (prefix <= 0 || prefix > traits_type::BITS || !contain(prefix)) {
+        return -1;
     }
-    
-    if (node->isRoot()) {
-        assert(node->root.child == oldPointer);
-        node->root.child = newPointer;
-        assert(node->root.child->getParent() == node);
-    } else {   
-        assert(node->isInner());
-        if (node->inner.zero == oldPointer) {
-            node->inner.zero = newPointer;
-        } else {
-            assert(node->inner.one == oldPointer);
-            node->inner.one = newPointer;
-        }
-        assert(node->inner.zero->getParent() == node);
-        assert(node->inner.one->getParent() == node);
+    prefixes &= ~(static_cast<key_type>(1) << (prefix - 1));
+    return 0;
+}
+
+template<class K>
+typename BasicDataNode<K>::prefix_type BasicDataNode<K>::getMaxPrefix() const
+{
+    assert(!empty());
+    return traits_type::BITS - traits_type::clz(prefixes);
+}
+
+template<class K>
+typename BasicDataNode<K>::prefix_type BasicDataNode<K>::getMaxPrefixForIp(key_type ip_, key_type covering) const
+{
+    // Prefixes not longer than the common leading bits match
+    key_type diff = ip ^ ip_;
+    key_type matching = prefixes | covering;
+    if (diff != 0) {
+        matching &= prefixesUpTo<key_type>(traits_type::clz(diff));
     }
+    return matching == 0 ? -1 : traits_type::BITS - traits_type::clz(matching);
+}
+
+template<class K>
+typename BasicDataNode<K>::key_type BasicDataNode<K>::prefixesCovering(key_type ip_) const
+{
+    key_type diff = ip ^ ip_;
+    return diff == 0 ? prefixes : prefixes & prefixesUpTo<key_type>(traits_type::clz(diff));
+}
+
+template<class K>
+typename BasicDataNode<K>::key_type BasicDataNode<K>::prefixesFrom(prefix_type mask) const
+{
+    return mask <= 1 ? prefixes : prefixes & ~prefixesUpTo<key_type>(mask - 1);
+}
+
+template<class K>
+bool BasicDataNode<K>::inside(key_type base, prefix_type mask) const
+{
+    return ((ip ^ base) & netmask<key_type>(mask)) == 0;
+}
+
+template<class K>
+int BasicDataNode<K>::rank(prefix_type prefix) const
+{
+    return traits_type::popcount(prefixes & prefixesUpTo<key_type>(prefix - 1));
+}
+
+/** Node implementation **/
 
-    if (newPointer->isInner() && newPointer->inner.zero != node_pointer()) {
-        assert(newPointer->inner.one != node_pointer());
-        newPointer->inner.zero->setParent(newPointer);
-        newPointer->inner.one->setParent(newPointer);
+template<class N, class D, class P>
+Node<N,D,P>::Node()
+{
+    setRoot();
+}
+
+template<class N, class D, class P>
+Node<N,D,P>::Node(const node_type& node)
+{
+    if (node.isLeaf()) {
+        leaf = node.leaf;
+    } else if (node.isRoot()) {
+        root = node.root;
+    } else {
+        inner = node.inner;
     }
 }
 
+template<class N, class D, class P>
+bool Node<N,D,P>::isRoot() const {
+    return root.flag == static_cast<uint32_t>(-2);
+}
+
+template<class N, class D, class P>
+bool Node<N,D,P>::isLeaf() const {
+    return leaf.flag == static_cast<uint32_t>(-1);
+}
+
+template<class N, class D, class P>
+bool Node<N,D,P>::isInner() const {
+    return !isLeaf() && !isRoot();
+}
+
+template<class N, class D, class P>
+void Node<N,D,P>::setRoot() {
+    root.flag = static_cast<uint32_t>(-2);
+}
+
+template<class N, class D, class P>
+void Node<N,D,P>::setLeaf() {
+    leaf.flag = static_cast<uint32_t>(-1);
+}
+
+template<class N, class D, class P>
+void Node<N,D,P>::setInner() {
+    leaf.flag = 0;
+}
+
 #endif /* IPCONTAINER_HPP */
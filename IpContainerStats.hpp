@@ -0,0 +1,94 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef IPCONTAINERSTATS_HPP
+#define IPCONTAINERSTATS_HPP
+
+#include <atomic>
+#include <cstring>
+#include <stdint.h>
+
+/**
+ * Instrumentation counters, compiled in with -DIPCONTAINER_STATS. Without the
+ * flag IPCONTAINER_COUNT expands to nothing and containers hold no counters.
+ */
+#ifdef IPCONTAINER_STATS
+#define IPCONTAINER_COUNT(counter, n) ((counter).add(n))
+#else
+#define IPCONTAINER_COUNT(counter, n) ((void)0)
+#endif
+
+/**
+ * Counter written by the thread that owns the container and read by any
+ * thread. A relaxed load and store replace the atomic add, so an increment
+ * costs the same as on a plain integer and a reader never takes a lock.
+ */
+class StatCounter {
+public:
+    StatCounter() : value(0) {}
+
+    void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value;
+
+    StatCounter(const StatCounter&);
+    StatCounter& operator=(const StatCounter&);
+};
+
+/**
+ * Copy of the counters of one container, see BasicIpContainer::stats(). All
+ * fields stay 0 when the counters are not compiled in.
+ */
+struct IpContainerStats {
+    // A walk passes at most 128 inner nodes (IPv6)
+    static const int MAX_DEPTH = 128;
+
+    // check() and every address of checkBatch()
+    uint64_t lookups;
+    // Lookups that found a prefix, the default route included
+    uint64_t hits;
+    uint64_t misses;
+    // Nodes read by lookups, the leaf included
+    uint64_t lookupNodes;
+    // Lookups by the number of inner nodes passed
+    uint64_t depths[MAX_DEPTH + 1];
+
+    // Successful add() and del() calls
+    uint64_t adds;
+    uint64_t dels;
+    // Nodes add() and del() passed on the way to the leaf they changed
+    uint64_t updateNodes;
+
+    // Arena resizes, and the bytes copied by the ones that moved slots.
+    // Only the first chunk ever moves (see ChunkStorage).
+    uint64_t reallocs;
+    uint64_t bytesMoved;
+    // Links fixed after compaction moved a node (UpdateChunk)
+    uint64_t chunkMoves;
+
+    IpContainerStats() { memset(this, 0, sizeof(*this)); }
+};
+
+#endif /* IPCONTAINERSTATS_HPP */
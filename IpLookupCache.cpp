@@ -0,0 +1,83 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <cassert>
+
+#include "IpLookupCache.hpp"
+
+
+/** BasicIpLookupCache implementation **/
+
+template<class P, class K>
+BasicIpLookupCache<P,K>::BasicIpLookupCache(container_type& container_, int bits)
+    : container(&container_)
+    , entries(static_cast<size_t>(1) << bits)
+    , shift(64 - bits + 1)
+    , seenGeneration(container_.generation())
+    , tag(1)
+    , hitCount(0)
+    , missCount(0)
+{
+    assert(bits > 1 && bits < 32);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].tag = 0;
+    }
+}
+
+template<class P, class K>
+void BasicIpLookupCache<P,K>::clear()
+{
+    seenGeneration = container->generation();
+    if (++tag != 0) {
+        return;
+    }
+    // The tag wrapped, old entries could match again
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].tag = 0;
+    }
+    tag = 1;
+}
+
+template<class P, class K>
+uint64_t BasicIpLookupCache<P,K>::hits() const
+{
+    return hitCount;
+}
+
+template<class P, class K>
+uint64_t BasicIpLookupCache<P,K>::misses() const
+{
+    return missCount;
+}
+
+template<class P, class K>
+double BasicIpLookupCache<P,K>::hitRate() const
+{
+    uint64_t lookups = hitCount + missCount;
+    return lookups == 0 ? 0 : static_cast<double>(hitCount) / lookups;
+}
+
+template class BasicIpLookupCache<CompactingPolicy>;
+template class BasicIpLookupCache<FreeListPolicy>;
+template class BasicIpLookupCache<CompactingPolicy, unsigned __int128>;
+template class BasicIpLookupCache<FreeListPolicy, unsigned __int128>;
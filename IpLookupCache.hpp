@@ -0,0 +1,118 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef IPLOOKUPCACHE_HPP
+#define IPLOOKUPCACHE_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "IpContainer.hpp"
+
+/**
+ * Two-way set associative cache of check() results in front of a
+ * BasicIpContainer.
+ *
+ * Meant for skewed traffic, where a few thousand destinations make up most
+ * lookups. A cache belongs to one thread and is small enough to keep one per
+ * thread; the container must not be changed while it looks up in it.
+ *
+ * Results are tagged with the container generation they were looked up in.
+ * When add(), del() or any other update changes the generation, the next
+ * check() drops every entry at once by moving to a new tag.
+ */
+template<class Policy = CompactingPolicy, class Key = uint32_t>
+class BasicIpLookupCache {
+public:
+    typedef BasicIpContainer<Policy, Key>             container_type;
+    typedef Key                                       key_type;
+    typedef typename container_type::prefix_type      prefix_type;
+
+    // Holds 2^bits entries in sets of two, 16k take 192 KiB for IPv4
+    explicit BasicIpLookupCache(container_type& container, int bits = 14);
+
+    prefix_type check(key_type ip);
+    void clear();
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+    // Share of lookups served from the cache, 0 before the first one
+    double hitRate() const;
+
+private:
+    static const int WAYS = 2;
+
+    struct Entry {
+        key_type ip;
+        uint32_t tag;
+        prefix_type result;
+    };
+
+    container_type* container;
+    std::vector<Entry> entries;
+    int shift;
+    uint64_t seenGeneration;
+    // Entries with another tag are empty. Tag 0 is never current.
+    uint32_t tag;
+    uint64_t hitCount;
+    uint64_t missCount;
+
+    static uint64_t fold(uint32_t ip) { return ip; }
+    static uint64_t fold(unsigned __int128 ip) { return static_cast<uint64_t>(ip >> 64) ^ static_cast<uint64_t>(ip); }
+};
+
+typedef BasicIpLookupCache<> IpLookupCache;
+
+
+/** BasicIpLookupCache implementation **/
+
+template<class P, class K>
+inline typename BasicIpLookupCache<P,K>::prefix_type BasicIpLookupCache<P,K>::check(key_type ip)
+{
+    if (container->generation() != seenGeneration) {
+        clear();
+    }
+    // Fibonacci hashing, the top bits pick the set
+    Entry* set = &entries[((fold(ip) * 0x9e3779b97f4a7c15ull) >> shift) * WAYS];
+    if (set[0].tag == tag && set[0].ip == ip) {
+        ++hitCount;
+        return set[0].result;
+    }
+    // The way used last is kept first, the other one is replaced
+    Entry other = set[0];
+    if (set[1].tag == tag && set[1].ip == ip) {
+        ++hitCount;
+        set[0] = set[1];
+        set[1] = other;
+        return set[0].result;
+    }
+    ++missCount;
+    set[1] = other;
+    set[0].ip = ip;
+    set[0].tag = tag;
+    set[0].result = container->check(ip);
+    return set[0].result;
+}
+
+#endif /* IPLOOKUPCACHE_HPP */
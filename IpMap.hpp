@@ -0,0 +1,103 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef IPMAP_HPP
+#define IPMAP_HPP
+
+#include <cstring>
+#include <type_traits>
+
+#include "IpContainer.hpp"
+
+/**
+ * BasicIpContainer with a Value for every route, a next hop or a policy id,
+ * which check() returns with the match.
+ *
+ * Values live in one dense array next to the node arena, the values of a
+ * leaf in one run, so storing them takes no allocation of its own. They are
+ * moved as bytes, hence trivially copyable only; larger payloads go into a
+ * table of their own and the map holds indices into it.
+ *
+ * Routes added without a value, by add(base, mask), bulkLoad() or apply(),
+ * get a zero-filled one. save() and open() aren't supported.
+ */
+template<class Value, class Policy = CompactingPolicy, class Key = uint32_t>
+class BasicIpMap : public BasicIpContainer<Policy, Key> {
+    static_assert(std::is_trivially_copyable<Value>::value, "Values are moved as bytes");
+    typedef BasicIpContainer<Policy, Key>             base_type;
+public:
+    typedef Value                                     value_type;
+    typedef typename base_type::key_type              key_type;
+    typedef typename base_type::prefix_type           prefix_type;
+
+    BasicIpMap() : base_type(sizeof(Value)) {}
+
+    using base_type::add;
+    using base_type::check;
+
+    // Stores the route, or sets its value when it is stored already
+    int add(key_type base, prefix_type mask, const value_type& value);
+    // Value of the stored route base/mask. Returns -1 if there is none.
+    int find(key_type base, prefix_type mask, value_type& value);
+    // Longest match as check() gives it, value is set unless that is -1
+    prefix_type check(key_type ip, value_type& value) const;
+};
+
+typedef BasicIpMap<uint32_t> IpMap;
+
+
+/** BasicIpMap implementation **/
+
+template<class V, class P, class K>
+int BasicIpMap<V,P,K>::add(key_type base, prefix_type mask, const value_type& value)
+{
+    if (base_type::add(base, mask) == -1) {
+        return -1;
+    }
+    memcpy(this->valueOf(base, mask), &value, sizeof(value));
+    return 0;
+}
+
+template<class V, class P, class K>
+int BasicIpMap<V,P,K>::find(key_type base, prefix_type mask, value_type& value)
+{
+    const char* bytes = this->valueOf(base, mask);
+    if (bytes == 0) {
+        return -1;
+    }
+    memcpy(&value, bytes, sizeof(value));
+    return 0;
+}
+
+template<class V, class P, class K>
+inline typename BasicIpMap<V,P,K>::prefix_type BasicIpMap<V,P,K>::check(key_type ip, value_type& value) const
+{
+    const char* bytes;
+    prefix_type prefix = this->checkValue(ip, bytes);
+    if (bytes != 0) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return prefix;
+}
+
+#endif /* IPMAP_HPP */
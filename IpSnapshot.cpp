@@ -0,0 +1,345 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <chrono>
+#include <algorithm>
+#include <cassert>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IPSNAPSHOT_X86 1
+#endif
+
+#include "IpSnapshot.hpp"
+
+namespace {
+
+const uint32_t CHUNK = static_cast<uint32_t>(1) << 31;
+const size_t ROOT_BITS = 16;
+const size_t CHUNK_BITS = 8;
+
+#ifdef IPSNAPSHOT_X86
+
+// The kernels look up whole vectors of addresses and return how many they
+// did; the caller finishes the rest with check(). Lanes whose entry still
+// points to a chunk gather again, the others keep their result. A stride is
+// skipped when no lane needs it.
+__attribute__((target("avx2")))
+size_t checkBatchAvx2(const uint32_t* table, const uint32_t* ips, char* out, size_t n)
+{
+    const int* base = reinterpret_cast<const int*>(table);
+    const __m256i offsetBits = _mm256_set1_epi32(~CHUNK);
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    // Low byte of every 32-bit entry to the bottom of its 128-bit half
+    const __m256i pickBytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i joinHalves = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i ip = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ips + i));
+        __m256i entry = _mm256_i32gather_epi32(base, _mm256_srli_epi32(ip, 16), 4);
+        __m256i chunk = _mm256_srai_epi32(entry, 31);
+        if (!_mm256_testz_si256(chunk, chunk)) {
+            __m256i index = _mm256_add_epi32(_mm256_and_si256(entry, offsetBits),
+                                             _mm256_and_si256(_mm256_srli_epi32(ip, 8), byteMask));
+            entry = _mm256_mask_i32gather_epi32(entry, base, index, chunk, 4);
+            chunk = _mm256_srai_epi32(entry, 31);
+            if (!_mm256_testz_si256(chunk, chunk)) {
+                index = _mm256_add_epi32(_mm256_and_si256(entry, offsetBits), _mm256_and_si256(ip, byteMask));
+                entry = _mm256_mask_i32gather_epi32(entry, base, index, chunk, 4);
+            }
+        }
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(entry, pickBytes), joinHalves);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(bytes));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+size_t checkBatchAvx512(const uint32_t* table, const uint32_t* ips, char* out, size_t n)
+{
+    const __m512i offsetBits = _mm512_set1_epi32(~CHUNK);
+    const __m512i chunkBit = _mm512_set1_epi32(CHUNK);
+    const __m512i byteMask = _mm512_set1_epi32(0xff);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i ip = _mm512_loadu_si512(ips + i);
+        __m512i entry = _mm512_i32gather_epi32(_mm512_srli_epi32(ip, 16), table, 4);
+        __mmask16 chunk = _mm512_test_epi32_mask(entry, chunkBit);
+        if (chunk) {
+            __m512i index = _mm512_add_epi32(_mm512_and_si512(entry, offsetBits),
+                                             _mm512_and_si512(_mm512_srli_epi32(ip, 8), byteMask));
+            entry = _mm512_mask_i32gather_epi32(entry, chunk, index, table, 4);
+            chunk = _mm512_test_epi32_mask(entry, chunkBit);
+            if (chunk) {
+                index = _mm512_add_epi32(_mm512_and_si512(entry, offsetBits), _mm512_and_si512(ip, byteMask));
+                entry = _mm512_mask_i32gather_epi32(entry, chunk, index, table, 4);
+            }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm512_cvtepi32_epi8(entry));
+    }
+    return i;
+}
+
+#endif
+
+} // namespace
+
+
+IpSnapshot::IpSnapshot()
+    : table(static_cast<size_t>(1) << ROOT_BITS, static_cast<uint8_t>(-1))
+    , lastCompileTime(0)
+    , fastestKernel(KERNEL_AUTO)
+{
+}
+
+template<class Policy>
+void IpSnapshot::compile(const BasicIpContainer<Policy>& container)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    table.resize(static_cast<size_t>(1) << ROOT_BITS);
+    freeChunks.clear();
+    for (uint32_t i = 0; i < (1 << ROOT_BITS); ++i) {
+        uint32_t entry = compileEntry(container, container.at(container.root).root.child, 0, i << (32 - ROOT_BITS), ROOT_BITS);
+        table[i] = entry;
+    }
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    lastCompileTime = duration.count();
+    calibrate();
+}
+
+template<class Policy>
+void IpSnapshot::refresh(const BasicIpContainer<Policy>& container, uint32_t base, char mask)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    uint32_t first = base >> (32 - ROOT_BITS);
+    uint32_t count = mask >= ROOT_BITS ? 1 : static_cast<uint32_t>(1) << (ROOT_BITS - mask);
+    refreshRoot(container, first, count);
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    lastCompileTime = duration.count();
+    if (fastestKernel == KERNEL_AUTO) {
+        calibrate();
+    }
+}
+
+template<class Policy>
+void IpSnapshot::refresh(const BasicIpContainer<Policy>& container, std::vector<std::pair<uint32_t, char> > prefixes)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Root entries under each prefix, as [first, end) ranges. Prefixes
+    // either nest or don't overlap, so sorted ranges merge in one pass.
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    ranges.reserve(prefixes.size());
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        uint32_t first = prefixes[i].first >> (32 - ROOT_BITS);
+        char mask = prefixes[i].second;
+        uint32_t count = mask >= static_cast<char>(ROOT_BITS) ? 1 : static_cast<uint32_t>(1) << (ROOT_BITS - mask);
+        ranges.push_back(std::make_pair(first, first + count));
+    }
+    std::sort(ranges.begin(), ranges.end());
+    size_t merged = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (merged > 0 && ranges[i].first < ranges[merged - 1].second) {
+            ranges[merged - 1].second = std::max(ranges[merged - 1].second, ranges[i].second);
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    uint32_t entries = 0;
+    for (size_t i = 0; i < merged; ++i) {
+        entries += ranges[i].second - ranges[i].first;
+    }
+
+    if (entries > (static_cast<uint32_t>(1) << ROOT_BITS) / 2) {
+        compile(container);
+        return;
+    }
+    for (size_t i = 0; i < merged; ++i) {
+        refreshRoot(container, ranges[i].first, ranges[i].second - ranges[i].first);
+    }
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    lastCompileTime = duration.count();
+    // Snapshots of a ConcurrentIpContainer may never be compiled whole
+    if (fastestKernel == KERNEL_AUTO) {
+        calibrate();
+    }
+}
+
+template<class Policy>
+void IpSnapshot::refreshRoot(const BasicIpContainer<Policy>& container, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; ++i) {
+        releaseEntry(table[i]);
+        uint32_t entry = compileEntry(container, container.at(container.root).root.child, 0, i << (32 - ROOT_BITS), ROOT_BITS);
+        table[i] = entry;
+    }
+}
+
+template<class Policy>
+uint32_t IpSnapshot::compileEntry(const BasicIpContainer<Policy>& container, typename BasicIpContainer<Policy>::pointer node,
+                                  uint32_t cover, uint32_t base, char depth)
+{
+    // Entries of the next stride continue the walk where this one stopped
+    char result;
+    if (container.resolve(base, depth, node, cover, result)) {
+        return static_cast<uint8_t>(result);
+    }
+
+    assert(depth < 32);
+    uint32_t offset = allocateChunk();
+    for (uint32_t i = 0; i < (1 << CHUNK_BITS); ++i) {
+        uint32_t entry = compileEntry(container, node, cover, base | (i << (32 - depth - CHUNK_BITS)), depth + CHUNK_BITS);
+        table[offset + i] = entry;
+    }
+    return CHUNK | offset;
+}
+
+void IpSnapshot::calibrate()
+{
+    // Random addresses reach the chunks as well as the root table; a handful
+    // of rounds over a few thousand of them takes well under a millisecond
+    const size_t SAMPLE = 4096;
+    const int ROUNDS = 3;
+    std::vector<uint32_t> ips(SAMPLE);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < SAMPLE; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        ips[i] = state;
+    }
+    std::vector<char> out(SAMPLE);
+
+    Kernel kernels[] = {KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512};
+    double best = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!supports(kernels[k])) {
+            continue;
+        }
+        double fastest = 0;
+        for (int r = 0; r < ROUNDS; ++r) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            checkBatch(ips.data(), out.data(), SAMPLE, kernels[k]);
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            if (r == 0 || duration.count() < fastest) {
+                fastest = duration.count();
+            }
+        }
+        if (k == 0 || fastest < best) {
+            best = fastest;
+            fastestKernel = kernels[k];
+        }
+    }
+}
+
+uint32_t IpSnapshot::allocateChunk()
+{
+    if (!freeChunks.empty()) {
+        uint32_t offset = freeChunks.back();
+        freeChunks.pop_back();
+        return offset;
+    }
+    uint32_t offset = table.size();
+    table.resize(offset + (1 << CHUNK_BITS));
+    return offset;
+}
+
+void IpSnapshot::releaseEntry(uint32_t entry)
+{
+    if (!(entry & CHUNK)) {
+        return;
+    }
+    uint32_t offset = entry & ~CHUNK;
+    for (uint32_t i = 0; i < (1 << CHUNK_BITS); ++i) {
+        releaseEntry(table[offset + i]);
+    }
+    freeChunks.push_back(offset);
+}
+
+void IpSnapshot::checkBatch(const uint32_t* ips, char* out, size_t n, Kernel kernel) const
+{
+    if (kernel == KERNEL_AUTO) {
+        kernel = fastestKernel;
+    } else if (!supports(kernel)) {
+        kernel = KERNEL_SCALAR;
+    }
+
+    size_t i = 0;
+#ifdef IPSNAPSHOT_X86
+    if (kernel == KERNEL_AVX512) {
+        i = checkBatchAvx512(table.data(), ips, out, n);
+    } else if (kernel == KERNEL_AVX2) {
+        i = checkBatchAvx2(table.data(), ips, out, n);
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = check(ips[i]);
+    }
+}
+
+bool IpSnapshot::supports(Kernel kernel)
+{
+    switch (kernel) {
+#ifdef IPSNAPSHOT_X86
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    case KERNEL_AUTO:
+    case KERNEL_SCALAR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+IpSnapshot::Kernel IpSnapshot::kernel() const
+{
+    return fastestKernel;
+}
+
+double IpSnapshot::compileTime() const
+{
+    return lastCompileTime;
+}
+
+size_t IpSnapshot::memoryUsage() const
+{
+    return table.capacity() * sizeof(table_type::value_type);
+}
+
+template void IpSnapshot::compile(const BasicIpContainer<CompactingPolicy>&);
+template void IpSnapshot::compile(const BasicIpContainer<FreeListPolicy>&);
+template void IpSnapshot::refresh(const BasicIpContainer<CompactingPolicy>&, uint32_t, char);
+template void IpSnapshot::refresh(const BasicIpContainer<FreeListPolicy>&, uint32_t, char);
+template void IpSnapshot::refresh(const BasicIpContainer<CompactingPolicy>&, std::vector<std::pair<uint32_t, char> >);
+template void IpSnapshot::refresh(const BasicIpContainer<FreeListPolicy>&, std::vector<std::pair<uint32_t, char> >);
@@ -0,0 +1,123 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef IPSNAPSHOT_HPP
+#define IPSNAPSHOT_HPP
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+#include "IpContainer.hpp"
+
+/**
+ * Immutable lookup table compiled from an IpContainer.
+ *
+ * Addresses are split into 16-8-8 bit strides. The first stride indexes a
+ * 64k-entry root table, the next two index 256-entry chunks that are only
+ * created where the result depends on more bits. Root table and chunks live
+ * in one contiguous array, so check() costs at most three memory accesses.
+ *
+ * Each entry either holds the result of check() for the whole range it
+ * covers or the offset of the chunk for the next stride. compile() can be
+ * called again on the same snapshot; the array is reused. After a single
+ * add() or del(), refresh() rebuilds only the entries under that prefix.
+ *
+ * checkBatch() can walk 8 (AVX2) or 16 (AVX-512) addresses at once with
+ * gathers into the table. Whether that beats the scalar loop depends on how
+ * fast the CPU gathers, so compile() times the kernels the CPU supports on
+ * the new table and checkBatch() uses the fastest. A snapshot only ever
+ * refreshed times them on its first refresh().
+ */
+class IpSnapshot {
+public:
+    enum Kernel {
+        KERNEL_AUTO,
+        KERNEL_SCALAR,
+        KERNEL_AVX2,
+        KERNEL_AVX512
+    };
+
+    IpSnapshot();
+
+    template<class Policy>
+    void compile(const BasicIpContainer<Policy>& container);
+    // A prefix only changes the result for addresses inside it
+    template<class Policy>
+    void refresh(const BasicIpContainer<Policy>& container, uint32_t base, char mask);
+    // Same for a set of changed prefixes, nested ones are rebuilt once. Falls
+    // back to compile() when they cover most of the address space.
+    template<class Policy>
+    void refresh(const BasicIpContainer<Policy>& container, std::vector<std::pair<uint32_t, char> > prefixes);
+    char check(uint32_t ip) const;
+    // Same results as check() for every address. KERNEL_AUTO uses the kernel
+    // picked by compile(); a kernel the CPU can't run falls back to scalar.
+    void checkBatch(const uint32_t* ips, char* out, size_t n, Kernel kernel = KERNEL_AUTO) const;
+    static bool supports(Kernel kernel);
+    // Kernel KERNEL_AUTO runs, KERNEL_AUTO itself until the kernels were
+    // timed; checkBatch() then takes the scalar loop
+    Kernel kernel() const;
+
+    // Duration of the last compile() or refresh() in seconds
+    double compileTime() const;
+    // Bytes held by the lookup table
+    size_t memoryUsage() const;
+
+private:
+    typedef std::vector<uint32_t> table_type;
+
+    table_type table;
+    // Offsets of chunks released by refresh()
+    std::vector<uint32_t> freeChunks;
+    double lastCompileTime;
+    Kernel fastestKernel;
+
+    template<class Policy>
+    uint32_t compileEntry(const BasicIpContainer<Policy>& container, typename BasicIpContainer<Policy>::pointer node,
+                          uint32_t cover, uint32_t base, char depth);
+    template<class Policy>
+    void refreshRoot(const BasicIpContainer<Policy>& container, uint32_t first, uint32_t count);
+    void calibrate();
+    uint32_t allocateChunk();
+    void releaseEntry(uint32_t entry);
+};
+
+
+/** IpSnapshot implementation **/
+
+inline char IpSnapshot::check(uint32_t ip) const
+{
+    const uint32_t CHUNK = static_cast<uint32_t>(1) << 31;
+
+    uint32_t entry = table[ip >> 16];
+    if (entry & CHUNK) {
+        entry = table[(entry & ~CHUNK) + ((ip >> 8) & 0xff)];
+        if (entry & CHUNK) {
+            entry = table[(entry & ~CHUNK) + (ip & 0xff)];
+        }
+    }
+    return static_cast<char>(entry);
+}
+
+#endif /* IPSNAPSHOT_HPP */
@@ -0,0 +1,164 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MULTIIPCONTAINER_HPP
+#define MULTIIPCONTAINER_HPP
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+#include <stdint.h>
+
+#include "IpContainer.hpp"
+
+/**
+ * Many IPv4 route tables, one per VRF or tenant, in a single trie.
+ *
+ * The key of a route is its table id followed by its base, and a /mask of
+ * the table is a /(32 + mask) of the trie, so check(table, ip) is one walk
+ * and the tables share one node arena. A table takes no memory of its own,
+ * only its routes do; an empty table costs nothing.
+ *
+ * Tables never see each other's routes: every prefix of the trie is at
+ * least 32 long, so it covers addresses of its own table only.
+ */
+template<class Policy = CompactingPolicy>
+class BasicMultiIpContainer {
+public:
+    typedef uint32_t                                  table_type;
+    typedef uint32_t                                  key_type;
+    typedef char                                      prefix_type;
+    typedef BasicIpContainer<Policy, uint64_t>        trie_type;
+
+    int add(table_type table, key_type base, prefix_type mask);
+    int del(table_type table, key_type base, prefix_type mask);
+    // Longest prefix of table that contains ip, -1 if there is none
+    prefix_type check(table_type table, key_type ip);
+    // out[i] = check(tables[i], ips[i]), looked up with
+    // BasicIpContainer::checkBatch()
+    void checkBatch(const table_type* tables, const key_type* ips, prefix_type* out, size_t n);
+
+    // Call visitor(base, mask) for every route of table, ordered by base and
+    // then by mask
+    template<class Visitor>
+    void forEachRoute(table_type table, Visitor visitor) const;
+    // Removes every route of table, returns how many there were
+    size_t clear(table_type table);
+
+    // See BasicIpContainer::relayout(), the nodes of a table end up together
+    int relayout() { return trie.relayout(); }
+
+    IpContainerStats stats() const { return trie.stats(); }
+    uint64_t generation() const { return trie.generation(); }
+
+private:
+    // Addresses of one checkBatch() pass of the trie
+    static const size_t BATCH_SIZE = 256;
+    static const int TABLE_BITS = 32;
+
+    trie_type trie;
+
+    static uint64_t keyOf(table_type table, key_type ip) {
+        return static_cast<uint64_t>(table) << TABLE_BITS | ip;
+    }
+    static bool validate(prefix_type mask) {
+        return mask >= 0 && mask <= KeyTraits<key_type>::BITS;
+    }
+};
+
+template<class P>
+const size_t BasicMultiIpContainer<P>::BATCH_SIZE;
+template<class P>
+const int BasicMultiIpContainer<P>::TABLE_BITS;
+
+typedef BasicMultiIpContainer<> MultiIpContainer;
+
+
+/** BasicMultiIpContainer implementation **/
+
+template<class P>
+int BasicMultiIpContainer<P>::add(table_type table, key_type base, prefix_type mask)
+{
+    if (!validate(mask)) {
+        return -1;
+    }
+    return trie.add(keyOf(table, base), TABLE_BITS + mask);
+}
+
+template<class P>
+int BasicMultiIpContainer<P>::del(table_type table, key_type base, prefix_type mask)
+{
+    if (!validate(mask)) {
+        return -1;
+    }
+    return trie.del(keyOf(table, base), TABLE_BITS + mask);
+}
+
+template<class P>
+inline typename BasicMultiIpContainer<P>::prefix_type BasicMultiIpContainer<P>::check(table_type table, key_type ip)
+{
+    prefix_type prefix = trie.check(keyOf(table, ip));
+    return prefix == -1 ? -1 : prefix - TABLE_BITS;
+}
+
+template<class P>
+void BasicMultiIpContainer<P>::checkBatch(const table_type* tables, const key_type* ips, prefix_type* out, size_t n)
+{
+    uint64_t keys[BATCH_SIZE];
+    for (size_t first = 0; first < n; first += BATCH_SIZE) {
+        size_t count = std::min(n - first, BATCH_SIZE);
+        for (size_t i = 0; i < count; ++i) {
+            keys[i] = keyOf(tables[first + i], ips[first + i]);
+        }
+        trie.checkBatch(keys, out + first, count);
+        for (size_t i = 0; i < count; ++i) {
+            prefix_type& prefix = out[first + i];
+            prefix = prefix == -1 ? -1 : prefix - TABLE_BITS;
+        }
+    }
+}
+
+template<class P>
+template<class Visitor>
+void BasicMultiIpContainer<P>::forEachRoute(table_type table, Visitor visitor) const
+{
+    trie.forEachWithin(keyOf(table, 0), TABLE_BITS, [&](uint64_t base, prefix_type mask) {
+        visitor(static_cast<key_type>(base), static_cast<prefix_type>(mask - TABLE_BITS));
+    });
+}
+
+template<class P>
+size_t BasicMultiIpContainer<P>::clear(table_type table)
+{
+    std::vector<std::pair<key_type, prefix_type> > routes;
+    forEachRoute(table, [&](key_type base, prefix_type mask) {
+        routes.push_back(std::make_pair(base, mask));
+    });
+    for (size_t i = 0; i < routes.size(); ++i) {
+        del(table, routes[i].first, routes[i].second);
+    }
+    return routes.size();
+}
+
+#endif /* MULTIIPCONTAINER_HPP */
@@ -0,0 +1,212 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cassert>
+
+#include "ShardedIpContainer.hpp"
+
+
+/** BasicShardedIpContainer implementation **/
+
+template<class P, class K>
+BasicShardedIpContainer<P,K>::BasicShardedIpContainer(int bits_)
+    : bits(bits_)
+    , shift(KeyTraits<K>::BITS - bits_)
+    , table(static_cast<size_t>(1) << bits_)
+{
+    assert(bits > 0 && bits <= 16);
+    for (size_t i = 0; i < table.size(); ++i) {
+        table[i].routes = new shard_type();
+        table[i].shorter = -1;
+    }
+}
+
+template<class P, class K>
+BasicShardedIpContainer<P,K>::~BasicShardedIpContainer()
+{
+    for (size_t i = 0; i < table.size(); ++i) {
+        delete table[i].routes;
+    }
+}
+
+template<class P, class K>
+bool BasicShardedIpContainer<P,K>::validate(key_type base, prefix_type mask) const
+{
+    if (mask < 0 || mask > KeyTraits<K>::BITS) {
+        return false;
+    }
+    return mask == KeyTraits<K>::BITS || (base << mask) == 0;
+}
+
+template<class P, class K>
+void BasicShardedIpContainer<P,K>::updateShorter(key_type base, prefix_type mask)
+{
+    size_t first = shardOf(base);
+    size_t count = static_cast<size_t>(1) << (bits - mask);
+    for (size_t i = first; i < first + count; ++i) {
+        table[i].shorter = shortRoutes.check(static_cast<key_type>(i) << shift);
+    }
+}
+
+template<class P, class K>
+template<class Work>
+void BasicShardedIpContainer<P,K>::forEachShard(const std::vector<size_t>& shards, unsigned threads, Work work)
+{
+    size_t workerCount = std::min<size_t>(threads, shards.size());
+    if (workerCount <= 1) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            work(shards[i]);
+        }
+        return;
+    }
+
+    // Shards differ in size, so workers take the next one when they are
+    // done instead of a fixed share
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < shards.size(); i = next++) {
+            work(shards[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < workerCount; ++t) {
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+}
+
+template<class P, class K>
+int BasicShardedIpContainer<P,K>::add(key_type base, prefix_type mask)
+{
+    if (!validate(base, mask)) {
+        return -1;
+    }
+    if (mask >= bits) {
+        return table[shardOf(base)].routes->add(base, mask);
+    }
+    if (shortRoutes.add(base, mask) == -1) {
+        return -1;
+    }
+    updateShorter(base, mask);
+    return 0;
+}
+
+template<class P, class K>
+int BasicShardedIpContainer<P,K>::del(key_type base, prefix_type mask)
+{
+    if (!validate(base, mask)) {
+        return -1;
+    }
+    if (mask >= bits) {
+        return table[shardOf(base)].routes->del(base, mask);
+    }
+    if (shortRoutes.del(base, mask) == -1) {
+        return -1;
+    }
+    updateShorter(base, mask);
+    return 0;
+}
+
+template<class P, class K>
+int BasicShardedIpContainer<P,K>::apply(const BasicUpdateBatch<K>& batch, unsigned threads)
+{
+    typedef typename BasicUpdateBatch<K>::Update update_type;
+    for (size_t i = 0; i < batch.updates.size(); ++i) {
+        if (!validate(batch.updates[i].base, batch.updates[i].mask)) {
+            return -1;
+        }
+    }
+
+    BasicUpdateBatch<K> shorter;
+    std::vector<BasicUpdateBatch<K> > parts(table.size());
+    for (size_t i = 0; i < batch.updates.size(); ++i) {
+        const update_type& update = batch.updates[i];
+        if (update.mask < bits) {
+            shorter.updates.push_back(update);
+        } else {
+            parts[shardOf(update.base)].updates.push_back(update);
+        }
+    }
+
+    std::vector<size_t> shards;
+    for (size_t s = 0; s < parts.size(); ++s) {
+        if (!parts[s].empty()) {
+            shards.push_back(s);
+        }
+    }
+    forEachShard(shards, threads, [this, &parts](size_t s) { table[s].routes->apply(parts[s]); });
+
+    if (!shorter.empty()) {
+        shortRoutes.apply(shorter);
+        for (size_t i = 0; i < shorter.updates.size(); ++i) {
+            updateShorter(shorter.updates[i].base, shorter.updates[i].mask);
+        }
+    }
+    return 0;
+}
+
+template<class P, class K>
+void BasicShardedIpContainer<P,K>::checkBatch(const key_type* ips, prefix_type* out, size_t n, unsigned threads)
+{
+    // Counting sort by shard, starts[s] is where the group of shard s begins
+    std::vector<size_t> starts(table.size() + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+        ++starts[shardOf(ips[i]) + 1];
+    }
+    for (size_t s = 0; s < table.size(); ++s) {
+        starts[s + 1] += starts[s];
+    }
+    std::vector<key_type> grouped(n);
+    std::vector<size_t> order(n);
+    std::vector<size_t> fill(starts.begin(), starts.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+        size_t pos = fill[shardOf(ips[i])]++;
+        grouped[pos] = ips[i];
+        order[pos] = i;
+    }
+
+    std::vector<size_t> shards;
+    for (size_t s = 0; s < table.size(); ++s) {
+        if (starts[s + 1] > starts[s]) {
+            shards.push_back(s);
+        }
+    }
+    std::vector<prefix_type> results(n);
+    forEachShard(shards, threads, [&](size_t s) {
+        table[s].routes->checkBatch(&grouped[starts[s]], &results[starts[s]], starts[s + 1] - starts[s]);
+        for (size_t pos = starts[s]; pos < starts[s + 1]; ++pos) {
+            out[order[pos]] = results[pos] == -1 ? table[s].shorter : results[pos];
+        }
+    });
+}
+
+template class BasicShardedIpContainer<CompactingPolicy>;
+template class BasicShardedIpContainer<FreeListPolicy>;
+template class BasicShardedIpContainer<CompactingPolicy, unsigned __int128>;
+template class BasicShardedIpContainer<FreeListPolicy, unsigned __int128>;
@@ -0,0 +1,109 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef SHARDEDIPCONTAINER_HPP
+#define SHARDEDIPCONTAINER_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "IpContainer.hpp"
+
+/**
+ * BasicIpContainer split by the top `bits` bits of the address into 2^bits
+ * shards, each a trie with an arena of its own.
+ *
+ * A lookup picks the shard from a dispatch table and walks only its trie,
+ * which leaves out the levels that branch on the top bits. Prefixes shorter
+ * than `bits` span several shards; they are kept apart, and every slot of
+ * the table holds the longest of them covering its shard, the answer when
+ * the shard has none.
+ *
+ * Shards share nothing, so add() and del() of routes at least `bits` long
+ * may run on different threads as long as they go to different shards (see
+ * shardOf()). Shorter routes change the dispatch table and need the
+ * container to themselves, as do lookups.
+ */
+template<class Policy = CompactingPolicy, class Key = uint32_t>
+class BasicShardedIpContainer {
+public:
+    typedef BasicIpContainer<Policy, Key>             shard_type;
+    typedef Key                                       key_type;
+    typedef typename shard_type::prefix_type          prefix_type;
+
+    explicit BasicShardedIpContainer(int bits = 8);
+    ~BasicShardedIpContainer();
+
+    int add(key_type base, prefix_type mask);
+    int del(key_type base, prefix_type mask);
+    // Splits batch by shard and applies the parts on up to `threads` threads,
+    // see BasicIpContainer::apply(). Returns -1 and changes nothing if any
+    // update is invalid.
+    int apply(const BasicUpdateBatch<Key>& batch, unsigned threads = 1);
+    prefix_type check(key_type ip);
+    // Groups the addresses by shard and looks up each group with
+    // BasicIpContainer::checkBatch(), the groups on up to `threads` threads
+    void checkBatch(const key_type* ips, prefix_type* out, size_t n, unsigned threads = 1);
+
+    size_t shardCount() const { return table.size(); }
+    size_t shardOf(key_type ip) const { return static_cast<size_t>(ip >> shift); }
+
+private:
+    struct Slot {
+        shard_type* routes;
+        // Longest prefix shorter than bits that covers the shard, or -1
+        prefix_type shorter;
+    };
+
+    int bits;
+    int shift;
+    std::vector<Slot> table;
+    shard_type shortRoutes;
+
+    bool validate(key_type base, prefix_type mask) const;
+    // Refreshes Slot::shorter of the shards under base/mask
+    void updateShorter(key_type base, prefix_type mask);
+    // Calls work(shard) once for every shard in shards, on up to threads
+    // threads
+    template<class Work>
+    static void forEachShard(const std::vector<size_t>& shards, unsigned threads, Work work);
+
+    BasicShardedIpContainer(const BasicShardedIpContainer&);
+    BasicShardedIpContainer& operator=(const BasicShardedIpContainer&);
+};
+
+typedef BasicShardedIpContainer<> ShardedIpContainer;
+
+
+/** BasicShardedIpContainer implementation **/
+
+template<class P, class K>
+inline typename BasicShardedIpContainer<P,K>::prefix_type BasicShardedIpContainer<P,K>::check(key_type ip)
+{
+    const Slot& slot = table[shardOf(ip)];
+    prefix_type prefix = slot.routes->check(ip);
+    return prefix == -1 ? slot.shorter : prefix;
+}
+
+#endif /* SHARDEDIPCONTAINER_HPP */
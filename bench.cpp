@@ -0,0 +1,1202 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Mateusz Malicki (malicki.mateusz@gmail.com)
+ *   
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "IpContainer.hpp"
+#include "IpSnapshot.hpp"
+#include "ConcurrentIpContainer.hpp"
+#include "IpLookupCache.hpp"
+#include "ShardedIpContainer.hpp"
+#include "IpMap.hpp"
+#include "ArenaMemory.hpp"
+#include "MultiIpContainer.hpp"
+
+using namespace std;
+
+namespace {
+
+const size_t TABLE_SIZE = 1000000;
+const size_t QUERY_COUNT = 1000000;
+const size_t CONCURRENT_TABLE_SIZE = 200000;
+const size_t CHURN_TABLE_SIZE = 200000;
+const size_t CHURN_OPS = 1000000;
+const size_t IP6_TABLE_SIZE = 200000;
+// Distinct destinations of the skewed traffic, ranked by a Zipf law (s = 1)
+const size_t ZIPF_DESTINATIONS = 100000;
+// add() one by one, each timed; the arena reaches 2^23 nodes
+const size_t LATENCY_TABLE_SIZE = 4000000;
+const size_t BURST_TABLE_SIZE = 200000;
+const size_t BURST_SIZE = 4096;
+// Updates of one sharded apply(), spread over all shards
+const size_t SHARDED_BATCH_SIZE = 200000;
+const double CONCURRENT_DURATION = 2.0;
+// Small per-tenant tables, held apart or in one trie
+const size_t TENANT_TABLES = 4096;
+const size_t TENANT_ROUTES = 64;
+// Inputs of one kernel pass, small enough to stay in L1, and the passes
+const size_t KERNEL_INPUTS = 1024;
+const size_t KERNEL_PASSES = 16384;
+
+// Keeps lookup results alive so the compiler can't drop them
+std::atomic<unsigned> blackhole(0);
+
+typedef std::chrono::steady_clock clock_type;
+typedef std::vector<IpContainer::route_type> route_list;
+
+// Command line: --json, --repetitions=N, --filter=substring
+bool json = false;
+int repetitions = 3;
+std::string filter;
+
+struct Result {
+    std::string name;
+    // Timed results have ops, the others a single counter
+    size_t ops;
+    double seconds;
+    double median;
+    std::string counter;
+    double value;
+};
+
+std::vector<Result> results;
+
+double elapsed(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+uint32_t netmask(char mask)
+{
+    return mask == 0 ? 0 : static_cast<uint32_t>(-1) << (32 - mask);
+}
+
+bool enabled(const std::string& name)
+{
+    return name.find(filter) != std::string::npos;
+}
+
+// Whether the filter may pick benchmarks of the group named prefix/...,
+// its setup runs only then. A filter may lie in "prefix/" or start with the
+// tail of it and name benchmarks below; one without a '/' may also match
+// anywhere past it. Only the names it picks are reported.
+bool groupEnabled(const std::string& prefix)
+{
+    const std::string group = prefix + "/";
+    if (filter.find('/') == std::string::npos || group.find(filter) != std::string::npos) {
+        return true;
+    }
+    for (size_t i = 0; i < group.size(); ++i) {
+        if (filter.compare(0, group.size() - i, group, i, std::string::npos) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void report(const std::string& name, size_t ops, double seconds, double median)
+{
+    if (!enabled(name)) {
+        return;
+    }
+    Result result = {name, ops, seconds, median, "", 0};
+    results.push_back(result);
+    if (!json) {
+        cout << name << ": " << ops / seconds / 1e6 << " Mops/s ("
+             << seconds * 1e9 / ops << " ns/op, median "
+             << median * 1e9 / ops << " ns/op)" << endl;
+    }
+}
+
+void report(const std::string& name, size_t ops, double seconds)
+{
+    report(name, ops, seconds, seconds);
+}
+
+void reportValue(const std::string& name, const char* counter, double value)
+{
+    if (!enabled(name)) {
+        return;
+    }
+    Result result = {name, 0, 0, 0, counter, value};
+    results.push_back(result);
+    if (!json) {
+        cout << name << ": " << value << " " << counter << endl;
+    }
+}
+
+// Times body over `repetitions` runs, setup runs before each of them and
+// isn't timed. The fastest run is reported, the median shows the spread.
+void run(const std::string& name, size_t ops, const std::function<void()>& setup, const std::function<void()>& body)
+{
+    if (!enabled(name)) {
+        return;
+    }
+    std::vector<double> times;
+    for (int r = 0; r < repetitions; ++r) {
+        setup();
+        clock_type::time_point start = clock_type::now();
+        body();
+        times.push_back(elapsed(start));
+    }
+    std::sort(times.begin(), times.end());
+    report(name, ops, times.front(), times[times.size() / 2]);
+}
+
+void printJson()
+{
+    cout << "{\n  \"context\": {\n"
+         << "    \"library_build_type\": \""
+#ifdef NDEBUG
+         << "release"
+#else
+         << "debug"
+#endif
+         << "\",\n"
+         << "    \"repetitions\": " << repetitions << ",\n"
+         << "    \"table_size\": " << TABLE_SIZE << ",\n"
+         << "    \"query_count\": " << QUERY_COUNT << "\n"
+         << "  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        cout << (i ? ",\n" : "\n") << "    {\"name\": \"" << result.name << "\"";
+        if (result.counter.empty()) {
+            cout << ", \"iterations\": " << result.ops
+                 << ", \"real_time\": " << result.seconds * 1e9 / result.ops
+                 << ", \"median_time\": " << result.median * 1e9 / result.ops
+                 << ", \"time_unit\": \"ns\""
+                 << ", \"items_per_second\": " << result.ops / result.seconds;
+        } else {
+            cout << ", \"" << result.counter << "\": " << result.value;
+        }
+        cout << "}";
+    }
+    cout << "\n  ]\n}" << endl;
+}
+
+// dTLB load misses of the calling thread. Virtual machines often have no
+// such counter, available() is false then.
+class TlbMisses {
+public:
+    TlbMisses() {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~TlbMisses() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    bool available() const { return fd != -1; }
+    void start() {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t stop() {
+        uint64_t count = 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+// Anonymous memory of the process backed by transparent huge pages
+size_t anonHugePages()
+{
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == 0) {
+        return 0;
+    }
+    char line[256];
+    size_t kib = 0;
+    while (fgets(line, sizeof(line), file) != 0) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kib * 1024;
+}
+
+size_t heapUsage()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Route-table-like mask distribution: mostly /24 with a tail of shorter
+// aggregates.
+char routeMask(std::mt19937& rng)
+{
+    static const char masks[] = {24, 24, 24, 24, 24, 23, 22, 22, 21, 20, 19, 18, 17, 16};
+    return masks[rng() % sizeof(masks)];
+}
+
+// Synthetic table: uniform bases, masks uniform over /20 to /24
+char uniformMask(std::mt19937& rng)
+{
+    return 20 + rng() % 5;
+}
+
+void makeRoutes(route_list& routes, char (*randomMask)(std::mt19937&), std::mt19937& rng, size_t count)
+{
+    routes.resize(count);
+    for (size_t i = 0; i < routes.size(); ++i) {
+        char mask = randomMask(rng);
+        routes[i] = std::make_pair(rng() & netmask(mask), mask);
+    }
+}
+
+// Addresses inside stored prefixes
+void makeHits(const route_list& routes, std::vector<uint32_t>& ips, std::mt19937& rng)
+{
+    ips.resize(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        const IpContainer::route_type& route = routes[rng() % routes.size()];
+        ips[i] = route.first | (rng() & ~netmask(route.second));
+    }
+}
+
+// Traffic in which the destination of rank k comes with weight 1 / k
+void makeZipf(const std::vector<uint32_t>& destinations, std::vector<uint32_t>& ips, std::mt19937& rng)
+{
+    std::vector<double> weights(ZIPF_DESTINATIONS);
+    for (size_t k = 0; k < weights.size(); ++k) {
+        weights[k] = 1.0 / (k + 1);
+    }
+    std::discrete_distribution<size_t> rank(weights.begin(), weights.end());
+    ips.resize(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = destinations[rank(rng)];
+    }
+}
+
+// Addresses no stored prefix covers
+void makeMisses(IpContainer& container, std::vector<uint32_t>& ips, std::mt19937& rng)
+{
+    ips.clear();
+    while (ips.size() < QUERY_COUNT) {
+        uint32_t ip = rng();
+        if (container.check(ip) == -1) {
+            ips.push_back(ip);
+        }
+    }
+}
+
+// add, del, lookups and memory footprint of one table shape
+int benchTable(const std::string& shape, char (*randomMask)(std::mt19937&))
+{
+    if (!groupEnabled(shape)) {
+        return 0;
+    }
+
+    std::mt19937 rng(1);
+    route_list routes;
+    makeRoutes(routes, randomMask, rng, TABLE_SIZE);
+    std::unique_ptr<IpContainer> container;
+
+    run(shape + "/add", routes.size(),
+        [&]() { container.reset(new IpContainer()); },
+        [&]() {
+            for (size_t i = 0; i < routes.size(); ++i) {
+                container->add(routes[i].first, routes[i].second);
+            }
+        });
+
+    run(shape + "/bulkLoad", routes.size(),
+        [&]() { container.reset(new IpContainer()); },
+        [&]() { container->bulkLoad(routes.begin(), routes.end()); });
+
+    route_list sorted(routes);
+    std::sort(sorted.begin(), sorted.end());
+    run(shape + "/bulkLoad_sorted", sorted.size(),
+        [&]() { container.reset(new IpContainer()); },
+        [&]() { container->bulkLoad(sorted.begin(), sorted.end()); });
+
+    route_list shuffled(routes);
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    run(shape + "/del", shuffled.size(),
+        [&]() {
+            container.reset(new IpContainer());
+            container->bulkLoad(routes.begin(), routes.end());
+        },
+        [&]() {
+            for (size_t i = 0; i < shuffled.size(); ++i) {
+                container->del(shuffled[i].first, shuffled[i].second);
+            }
+        });
+
+    container.reset();
+    size_t heapBefore = heapUsage();
+    container.reset(new IpContainer());
+    for (size_t i = 0; i < routes.size(); ++i) {
+        container->add(routes[i].first, routes[i].second);
+    }
+    if (enabled(shape + "/memory")) {
+        reportValue(shape + "/memory", "bytes_per_prefix", double(heapUsage() - heapBefore) / routes.size());
+    }
+
+    // Cold start from a saved table: map it and serve the first lookup
+    const std::string path = "/tmp/bench-" + shape + ".bin";
+    std::unique_ptr<IpContainer> mapped;
+    run(shape + "/save", 1, []() {}, [&]() { container->save(path); });
+    run(shape + "/open", 1,
+        [&]() {
+            container->save(path);
+            mapped.reset(new IpContainer());
+        },
+        [&]() {
+            mapped->open(path);
+            blackhole += mapped->check(routes[0].first);
+        });
+    mapped.reset();
+    remove(path.c_str());
+
+    std::vector<uint32_t> hits;
+    std::vector<uint32_t> misses;
+    makeHits(routes, hits, rng);
+    makeMisses(*container, misses, rng);
+    std::vector<char> scalar(QUERY_COUNT);
+    std::vector<char> batch(QUERY_COUNT);
+    const std::vector<uint32_t>* ips = &hits;
+    const char* kinds[] = {"hit", "miss"};
+    for (int k = 0; k < 2; ++k, ips = &misses) {
+        std::string kind(kinds[k]);
+        run(shape + "/check_" + kind, ips->size(), []() {}, [&]() {
+            for (size_t i = 0; i < ips->size(); ++i) {
+                scalar[i] = container->check((*ips)[i]);
+            }
+        });
+        run(shape + "/checkBatch_" + kind, ips->size(), []() {}, [&]() {
+            container->checkBatch(ips->data(), batch.data(), ips->size());
+        });
+        if (enabled(shape + "/check_" + kind) && enabled(shape + "/checkBatch_" + kind) && scalar != batch) {
+            cerr << shape << ": checkBatch results differ from check" << endl;
+            return 1;
+        }
+
+        run(shape + "/forEachCovering_" + kind, ips->size(), []() {}, [&]() {
+            unsigned found = 0;
+            for (size_t i = 0; i < ips->size(); ++i) {
+                container->forEachCovering((*ips)[i], [&found](uint32_t, char) { ++found; });
+            }
+            blackhole += found;
+        });
+
+        IpSnapshot snapshot;
+        snapshot.compile(*container);
+        run(shape + "/snapshot_check_" + kind, ips->size(), []() {}, [&]() {
+            for (size_t i = 0; i < ips->size(); ++i) {
+                batch[i] = snapshot.check((*ips)[i]);
+            }
+        });
+        if (enabled(shape + "/check_" + kind) && enabled(shape + "/snapshot_check_" + kind) && scalar != batch) {
+            cerr << shape << ": snapshot results differ from check" << endl;
+            return 1;
+        }
+
+        // Blocks of 256, the size the ingest path hands over
+        const char* kernelNames[] = {"auto", "scalar", "avx2", "avx512"};
+        IpSnapshot::Kernel kernels[] = {IpSnapshot::KERNEL_AUTO, IpSnapshot::KERNEL_SCALAR,
+                                        IpSnapshot::KERNEL_AVX2, IpSnapshot::KERNEL_AVX512};
+        for (int v = 0; v < 4; ++v) {
+            std::string batchName = shape + "/snapshot_checkBatch_" + kernelNames[v] + "_" + kind;
+            if (!IpSnapshot::supports(kernels[v])) {
+                continue;
+            }
+            run(batchName, ips->size(), []() {}, [&]() {
+                for (size_t i = 0; i < ips->size(); i += 256) {
+                    snapshot.checkBatch(ips->data() + i, batch.data() + i, std::min<size_t>(256, ips->size() - i), kernels[v]);
+                }
+            });
+            if (enabled(shape + "/check_" + kind) && enabled(batchName) && scalar != batch) {
+                cerr << shape << ": snapshot " << kernelNames[v] << " results differ from check" << endl;
+                return 1;
+            }
+        }
+    }
+
+    std::vector<uint32_t> zipf;
+    makeZipf(hits, zipf, rng);
+    run(shape + "/zipf_check", zipf.size(), []() {}, [&]() {
+        for (size_t i = 0; i < zipf.size(); ++i) {
+            scalar[i] = container->check(zipf[i]);
+        }
+    });
+    std::unique_ptr<IpLookupCache> cache;
+    run(shape + "/zipf_cache", zipf.size(),
+        [&]() { cache.reset(new IpLookupCache(*container)); },
+        [&]() {
+            for (size_t i = 0; i < zipf.size(); ++i) {
+                batch[i] = cache->check(zipf[i]);
+            }
+        });
+    if (enabled(shape + "/zipf_check") && enabled(shape + "/zipf_cache")) {
+        if (scalar != batch) {
+            cerr << shape << ": cached results differ from check" << endl;
+            return 1;
+        }
+        reportValue(shape + "/zipf_cache_hit_rate", "%", cache->hitRate() * 100);
+    }
+
+    run(shape + "/iterate", routes.size(), []() {}, [&]() {
+        unsigned masks = 0;
+        for (IpContainer::const_iterator it = container->begin(); it != container->end(); ++it) {
+            masks += it->second;
+        }
+        blackhole += masks;
+    });
+    {
+        // Same routes in van Emde Boas order, subtrees are contiguous
+        IpContainer laidOut;
+        laidOut.bulkLoad(routes.begin(), routes.end());
+        laidOut.relayout();
+        run(shape + "/iterate_relayout", routes.size(), []() {}, [&]() {
+            unsigned masks = 0;
+            for (IpContainer::const_iterator it = laidOut.begin(); it != laidOut.end(); ++it) {
+                masks += it->second;
+            }
+            blackhole += masks;
+        });
+    }
+
+    // Audit of the /16 around every hit
+    run(shape + "/forEachWithin_16", hits.size(), []() {}, [&]() {
+        unsigned found = 0;
+        for (size_t i = 0; i < hits.size(); ++i) {
+            container->forEachWithin(hits[i] & 0xffff0000, 16, [&found](uint32_t, char) { ++found; });
+        }
+        blackhole += found;
+    });
+
+    if (enabled(shape + "/snapshot_compile")) {
+        IpSnapshot snapshot;
+        snapshot.compile(*container);
+        reportValue(shape + "/snapshot_compile", "ms", snapshot.compileTime() * 1e3);
+        reportValue(shape + "/snapshot_memory", "KiB", snapshot.memoryUsage() / 1024);
+    }
+    return 0;
+}
+
+// BGP-style flaps: routes are withdrawn and announced again
+template<class Policy>
+void benchChurn(const std::string& name)
+{
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(3);
+    BasicIpContainer<Policy> container;
+    std::vector<uint32_t> bases;
+    std::vector<char> masks;
+    while (bases.size() < CHURN_TABLE_SIZE) {
+        char mask = routeMask(rng);
+        uint32_t base = rng() & netmask(mask);
+        if (container.check(base) != mask && container.add(base, mask) == 0) {
+            bases.push_back(base);
+            masks.push_back(mask);
+        }
+    }
+
+    // Withdraw a burst of routes, then announce them again
+    const size_t BURST = 5000;
+    clock_type::time_point start = clock_type::now();
+    size_t ops = 0;
+    while (ops < CHURN_OPS) {
+        size_t first = rng() % (bases.size() - BURST);
+        for (size_t i = first; i < first + BURST; ++i) {
+            container.del(bases[i], masks[i]);
+        }
+        for (size_t i = first; i < first + BURST; ++i) {
+            container.add(bases[i], masks[i]);
+        }
+        ops += 2 * BURST;
+    }
+    report(name, ops, elapsed(start));
+
+    // Lookups on the churned arena, after relayout() and on a fresh build
+    std::vector<uint32_t> ips(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        size_t r = rng() % bases.size();
+        ips[i] = bases[r] | (rng() & ~netmask(masks[r]));
+    }
+    std::vector<char> out(ips.size());
+    run(name + "/check", ips.size(), []() {}, [&]() {
+        container.checkBatch(ips.data(), out.data(), ips.size());
+    });
+    start = clock_type::now();
+    container.relayout();
+    reportValue(name + "/relayout", "ms", elapsed(start) * 1e3);
+    run(name + "/check_relayout", ips.size(), []() {}, [&]() {
+        container.checkBatch(ips.data(), out.data(), ips.size());
+    });
+
+    BasicIpContainer<Policy> fresh;
+    for (size_t i = 0; i < bases.size(); ++i) {
+        fresh.add(bases[i], masks[i]);
+    }
+    run(name + "/check_fresh", ips.size(), []() {}, [&]() {
+        fresh.checkBatch(ips.data(), out.data(), ips.size());
+    });
+}
+
+// IPv6 table as seen in the global table: mostly /48 site and /32 to /44
+// provider aggregates, with /56 and /64 customer routes inside 2000::/3
+void benchIp6()
+{
+    if (!groupEnabled("ip6")) {
+        return;
+    }
+    static const short masks[] = {48, 48, 48, 48, 48, 32, 36, 40, 44, 56, 56, 64, 64};
+    std::mt19937_64 rng(4);
+    Ip6Container container;
+    std::vector<unsigned __int128> bases;
+    while (bases.size() < IP6_TABLE_SIZE) {
+        short mask = masks[rng() % (sizeof(masks) / sizeof(masks[0]))];
+        unsigned __int128 base = static_cast<unsigned __int128>((rng() >> 3) | (static_cast<uint64_t>(1) << 61)) << 64;
+        base &= ~((static_cast<unsigned __int128>(1) << (128 - mask)) - 1);
+        if (container.add(base, mask) == 0) {
+            bases.push_back(base);
+        }
+    }
+
+    std::vector<unsigned __int128> ips(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        if (i % 2) {
+            ips[i] = bases[rng() % bases.size()] | rng();
+        } else {
+            ips[i] = static_cast<unsigned __int128>(rng()) << 64 | rng();
+        }
+    }
+    std::vector<short> results(ips.size());
+
+    run("ip6/check", ips.size(), []() {}, [&]() {
+        unsigned sink = 0;
+        for (size_t i = 0; i < ips.size(); ++i) {
+            sink += container.check(ips[i]);
+        }
+        blackhole += sink;
+    });
+    run("ip6/checkBatch", ips.size(), []() {}, [&]() {
+        container.checkBatch(ips.data(), results.data(), ips.size());
+    });
+}
+
+// One writer republishes the table while readerCount threads look up
+void benchConcurrent(size_t readerCount)
+{
+    std::ostringstream name;
+    name << "route/concurrent_check/readers:" << readerCount;
+    if (!groupEnabled(name.str())) {
+        return;
+    }
+
+    std::mt19937 rng(2);
+    ConcurrentIpContainer container;
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, CONCURRENT_TABLE_SIZE);
+    for (size_t i = 0; i < routes.size(); ++i) {
+        container.add(routes[i].first, routes[i].second);
+    }
+    container.publish();
+    std::vector<uint32_t> ips(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = i % 2 ? routes[rng() % routes.size()].first | (rng() & 0xff) : rng();
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<size_t> lookups(0);
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < readerCount; ++r) {
+        readers.push_back(std::thread([&container, &done, &lookups, &ips, r]() {
+            ConcurrentIpContainer::Reader reader = container.reader();
+            size_t i = r * 7919;
+            size_t count = 0;
+            unsigned sink = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                for (int k = 0; k < 1024; ++k, ++i) {
+                    sink += reader.check(ips[i % ips.size()]);
+                }
+                count += 1024;
+            }
+            lookups += count;
+            blackhole += sink;
+        }));
+    }
+
+    size_t publishes = 0;
+    clock_type::time_point start = clock_type::now();
+    while (elapsed(start) < CONCURRENT_DURATION) {
+        if (publishes % 2) {
+            container.del(0x7f000000, 24);
+        } else {
+            container.add(0x7f000000, 24);
+        }
+        container.publish();
+        ++publishes;
+    }
+    done.store(true);
+    for (size_t r = 0; r < readers.size(); ++r) {
+        readers[r].join();
+    }
+    report(name.str(), lookups.load(), elapsed(start));
+    reportValue(name.str() + "/publishes", "count", publishes);
+}
+
+// A burst of withdrawals and announcements, one by one or as one batch
+void benchBurst()
+{
+    const std::string name = "route/burst";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(5);
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, BURST_TABLE_SIZE + BURST_SIZE / 2);
+    route_list table(routes.begin(), routes.begin() + BURST_TABLE_SIZE);
+    route_list adds(routes.begin() + BURST_TABLE_SIZE, routes.end());
+    route_list dels;
+    for (size_t i = 0; i < BURST_SIZE / 2; ++i) {
+        dels.push_back(table[rng() % table.size()]);
+    }
+    UpdateBatch batch;
+    for (size_t i = 0; i < dels.size(); ++i) {
+        batch.del(dels[i].first, dels[i].second);
+        batch.add(adds[i].first, adds[i].second);
+    }
+
+    std::unique_ptr<IpContainer> container;
+    auto load = [&]() {
+        container.reset(new IpContainer());
+        container->bulkLoad(table.begin(), table.end());
+    };
+    run(name + "/add_del", BURST_SIZE, load, [&]() {
+        for (size_t i = 0; i < dels.size(); ++i) {
+            container->del(dels[i].first, dels[i].second);
+            container->add(adds[i].first, adds[i].second);
+        }
+    });
+    run(name + "/apply", BURST_SIZE, load, [&]() { container->apply(batch); });
+
+    // Published, readers see the burst as one change
+    std::unique_ptr<ConcurrentIpContainer> concurrent;
+    auto loadConcurrent = [&]() {
+        concurrent.reset(new ConcurrentIpContainer());
+        UpdateBatch initial;
+        for (size_t i = 0; i < table.size(); ++i) {
+            initial.add(table[i].first, table[i].second);
+        }
+        concurrent->apply(initial);
+        // Both snapshots hold the table, as they do between bursts
+        concurrent->publish();
+    };
+    run(name + "/publish_add_del", BURST_SIZE, loadConcurrent, [&]() {
+        for (size_t i = 0; i < dels.size(); ++i) {
+            concurrent->del(dels[i].first, dels[i].second);
+            concurrent->add(adds[i].first, adds[i].second);
+        }
+        concurrent->publish();
+    });
+    run(name + "/publish_apply", BURST_SIZE, loadConcurrent, [&]() { concurrent->apply(batch); });
+}
+
+// The route table split by the top 8 or 16 bits, against one trie
+void benchSharded()
+{
+    const std::string name = "route/sharded";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(6);
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, TABLE_SIZE);
+    std::vector<uint32_t> ips;
+    makeHits(routes, ips, rng);
+    std::vector<char> expected(ips.size());
+    std::vector<char> out(ips.size());
+
+    IpContainer container;
+    container.bulkLoad(routes.begin(), routes.end());
+    run(name + "/check_unsharded", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            expected[i] = container.check(ips[i]);
+        }
+    });
+    run(name + "/checkBatch_unsharded", ips.size(), []() {}, [&]() {
+        container.checkBatch(ips.data(), out.data(), ips.size());
+    });
+
+    // Empty shards are built in one pass each, as bulkLoad() built the trie
+    UpdateBatch initial;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        initial.add(routes[i].first, routes[i].second);
+    }
+    route_list extra;
+    makeRoutes(extra, routeMask, rng, SHARDED_BATCH_SIZE);
+    UpdateBatch batch;
+    for (size_t i = 0; i < extra.size(); ++i) {
+        batch.add(extra[i].first, extra[i].second);
+    }
+    std::unique_ptr<IpContainer> single;
+    run(name + "/apply_unsharded", batch.size(),
+        [&]() {
+            single.reset(new IpContainer());
+            single->bulkLoad(routes.begin(), routes.end());
+        },
+        [&]() { single->apply(batch); });
+    single.reset();
+    unsigned hardware = std::max(2u, std::thread::hardware_concurrency());
+
+    int shardBits[] = {8, 16};
+    for (int b = 0; b < 2; ++b) {
+        std::ostringstream prefix;
+        prefix << name << "/bits:" << shardBits[b];
+        std::unique_ptr<ShardedIpContainer> sharded;
+        auto load = [&]() {
+            sharded.reset(new ShardedIpContainer(shardBits[b]));
+            sharded->apply(initial);
+        };
+        load();
+        run(prefix.str() + "/check", ips.size(), []() {}, [&]() {
+            for (size_t i = 0; i < ips.size(); ++i) {
+                out[i] = sharded->check(ips[i]);
+            }
+        });
+        if (enabled(name + "/check_unsharded") && enabled(prefix.str() + "/check") && out != expected) {
+            cerr << name << ": sharded results differ from check" << endl;
+            return;
+        }
+        run(prefix.str() + "/checkBatch", ips.size(), []() {}, [&]() {
+            sharded->checkBatch(ips.data(), out.data(), ips.size());
+        });
+
+        unsigned threads[] = {1, hardware};
+        for (int t = 0; t < 2; ++t) {
+            std::ostringstream applyName;
+            applyName << prefix.str() << "/apply/threads:" << threads[t];
+            run(applyName.str(), batch.size(), load, [&]() { sharded->apply(batch, threads[t]); });
+        }
+    }
+}
+
+// Next hop of the match: from the map in the walk, or by a second lookup
+// keyed on the matched prefix
+void benchMap()
+{
+    const std::string name = "route/next_hop";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(7);
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, TABLE_SIZE);
+    std::vector<uint32_t> ips;
+    makeHits(routes, ips, rng);
+
+    size_t heapBefore = heapUsage();
+    IpContainer container;
+    container.bulkLoad(routes.begin(), routes.end());
+    std::unordered_map<uint64_t, uint32_t> nextHops;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        nextHops[static_cast<uint64_t>(routes[i].first) << 8 | routes[i].second] = rng();
+    }
+    size_t heapMiddle = heapUsage();
+    IpMap map;
+    map.bulkLoad(routes.begin(), routes.end());
+    for (size_t i = 0; i < routes.size(); ++i) {
+        map.add(routes[i].first, routes[i].second, nextHops[static_cast<uint64_t>(routes[i].first) << 8 | routes[i].second]);
+    }
+    reportValue(name + "/memory_check_hash", "bytes_per_prefix", double(heapMiddle - heapBefore) / routes.size());
+    reportValue(name + "/memory_map", "bytes_per_prefix", double(heapUsage() - heapMiddle) / routes.size());
+
+    std::vector<uint32_t> expected(ips.size());
+    std::vector<uint32_t> out(ips.size());
+    run(name + "/check_hash", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            char mask = container.check(ips[i]);
+            expected[i] = nextHops.find(static_cast<uint64_t>(ips[i] & netmask(mask)) << 8 | mask)->second;
+        }
+    });
+    run(name + "/map_check", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            map.check(ips[i], out[i]);
+        }
+    });
+    if (enabled(name + "/check_hash") && enabled(name + "/map_check") && out != expected) {
+        cerr << name << ": map values differ from the hash table" << endl;
+    }
+}
+
+// Lookups on the node arena in malloc() memory and in huge pages
+void benchArena()
+{
+    const std::string name = "route/arena";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(8);
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, TABLE_SIZE);
+    std::vector<uint32_t> ips;
+    makeHits(routes, ips, rng);
+    std::vector<char> out(ips.size());
+    TlbMisses tlbMisses;
+    if (!tlbMisses.available() && !json) {
+        cout << name << ": no dTLB miss counter, timings only" << endl;
+    }
+
+    const char* pageNames[] = {"default", "transparent", "hugetlb"};
+    for (int p = 0; p < 3; ++p) {
+        std::string pagesName = name + "/" + pageNames[p];
+        if (!groupEnabled(pagesName)) {
+            continue;
+        }
+        size_t hugeBefore = anonHugePages();
+        IpContainer container;
+        container.setArena(ArenaOptions(static_cast<ArenaOptions::Pages>(p)));
+        container.bulkLoad(routes.begin(), routes.end());
+        if (container.arena().pages != p) {
+            reportValue(pagesName + "/fallback_to", pageNames[container.arena().pages], 1);
+        }
+        reportValue(pagesName + "/huge_pages", "MiB", double(anonHugePages() - hugeBefore) / (1 << 20));
+
+        run(pagesName + "/check_hit", ips.size(), []() {}, [&]() {
+            for (size_t i = 0; i < ips.size(); ++i) {
+                out[i] = container.check(ips[i]);
+            }
+        });
+        if (tlbMisses.available() && enabled(pagesName + "/dtlb_misses")) {
+            tlbMisses.start();
+            for (size_t i = 0; i < ips.size(); ++i) {
+                out[i] = container.check(ips[i]);
+            }
+            reportValue(pagesName + "/dtlb_misses", "per_lookup", double(tlbMisses.stop()) / ips.size());
+        }
+    }
+}
+
+// Tail latency of single add() calls while the table grows from empty, the
+// arena grows with it. A mapped arena cannot be remapped in place the way
+// realloc() moves large blocks, there a growth step is a copy.
+void benchAddLatency()
+{
+    const std::string name = "route/add_latency";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(9);
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, LATENCY_TABLE_SIZE);
+    std::vector<double> latencies(routes.size());
+
+    const char* pageNames[] = {"default", "transparent"};
+    for (int p = 0; p < 2; ++p) {
+        std::string pagesName = name + "/" + pageNames[p];
+        if (!groupEnabled(pagesName)) {
+            continue;
+        }
+        IpContainer container;
+        container.setArena(ArenaOptions(static_cast<ArenaOptions::Pages>(p)));
+        clock_type::time_point start = clock_type::now();
+        for (size_t i = 0; i < routes.size(); ++i) {
+            clock_type::time_point before = clock_type::now();
+            container.add(routes[i].first, routes[i].second);
+            latencies[i] = std::chrono::duration<double>(clock_type::now() - before).count();
+        }
+        report(pagesName, routes.size(), elapsed(start));
+
+        std::sort(latencies.begin(), latencies.end());
+        reportValue(pagesName + "/p50", "ns", latencies[latencies.size() / 2] * 1e9);
+        reportValue(pagesName + "/p99", "ns", latencies[latencies.size() * 99 / 100] * 1e9);
+        reportValue(pagesName + "/p999", "ns", latencies[latencies.size() * 999 / 1000] * 1e9);
+        reportValue(pagesName + "/max", "us", latencies.back() * 1e6);
+    }
+}
+
+// Thousands of small tables, one container each against one shared trie
+void benchMultiTable()
+{
+    const std::string name = "route/multi_table";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(11);
+    // Routes of table t from t * TENANT_ROUTES on
+    route_list routes;
+    makeRoutes(routes, routeMask, rng, TENANT_TABLES * TENANT_ROUTES);
+    std::vector<uint32_t> tables(QUERY_COUNT);
+    std::vector<uint32_t> ips(QUERY_COUNT);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        size_t r = rng() % routes.size();
+        tables[i] = r / TENANT_ROUTES;
+        ips[i] = routes[r].first | (rng() & ~netmask(routes[r].second));
+    }
+
+    size_t heapBefore = heapUsage();
+    std::vector<std::unique_ptr<IpContainer> > separate(TENANT_TABLES);
+    for (size_t t = 0; t < separate.size(); ++t) {
+        separate[t].reset(new IpContainer());
+    }
+    size_t heapEmpty = heapUsage();
+    for (size_t i = 0; i < routes.size(); ++i) {
+        separate[i / TENANT_ROUTES]->add(routes[i].first, routes[i].second);
+    }
+    size_t heapMiddle = heapUsage();
+    MultiIpContainer shared;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        shared.add(i / TENANT_ROUTES, routes[i].first, routes[i].second);
+    }
+    reportValue(name + "/memory_empty_separate", "bytes_per_table", double(heapEmpty - heapBefore) / TENANT_TABLES);
+    reportValue(name + "/memory_separate", "bytes_per_prefix", double(heapMiddle - heapBefore) / routes.size());
+    reportValue(name + "/memory_shared", "bytes_per_prefix", double(heapUsage() - heapMiddle) / routes.size());
+
+    std::vector<char> expected(ips.size());
+    std::vector<char> out(ips.size());
+    run(name + "/check_separate", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            expected[i] = separate[tables[i]]->check(ips[i]);
+        }
+    });
+    run(name + "/check_shared", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            out[i] = shared.check(tables[i], ips[i]);
+        }
+    });
+    if (enabled(name + "/check_separate") && enabled(name + "/check_shared") && out != expected) {
+        cerr << name << ": shared trie differs from the separate tables" << endl;
+    }
+    // The nodes of every table together again, as after a bulk load
+    shared.relayout();
+    run(name + "/check_shared_relayout", ips.size(), []() {}, [&]() {
+        for (size_t i = 0; i < ips.size(); ++i) {
+            out[i] = shared.check(tables[i], ips[i]);
+        }
+    });
+    run(name + "/checkBatch_shared_relayout", ips.size(), []() {}, [&]() {
+        shared.checkBatch(&tables[0], &ips[0], &out[0], ips.size());
+    });
+    if (enabled(name + "/check_separate") && enabled(name + "/checkBatch_shared_relayout") && out != expected) {
+        cerr << name << ": shared trie differs from the separate tables" << endl;
+    }
+}
+
+// The hot path kernels against the scalar versions they replaced, on the
+// same inputs in the same loop
+void benchKernels()
+{
+    const std::string name = "kernel";
+    if (!groupEnabled(name)) {
+        return;
+    }
+    std::mt19937 rng(10);
+    std::vector<uint32_t> keys(KERNEL_INPUTS);
+    std::vector<uint32_t> others(KERNEL_INPUTS);
+    std::vector<char> masks(KERNEL_INPUTS);
+    std::vector<DataNode> nodes(KERNEL_INPUTS);
+    // Up to 4 prefixes of each base, longest first
+    std::vector<std::vector<char> > sorted(KERNEL_INPUTS);
+    for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+        masks[i] = rng() % 33;
+        keys[i] = rng() & netmask(24);
+        // Differs from the key past a route-table-like mask
+        others[i] = keys[i] ^ (1u << (31 - (routeMask(rng) + rng() % 8)));
+        nodes[i].ip = keys[i];
+        nodes[i].prefixes = 0;
+        for (int n = 1 + rng() % 4; n > 0; --n) {
+            char prefix = routeMask(rng);
+            if (!nodes[i].contain(prefix)) {
+                nodes[i].addPrefix(prefix);
+                sorted[i].push_back(prefix);
+            }
+        }
+        std::sort(sorted[i].rbegin(), sorted[i].rend());
+    }
+    const size_t ops = KERNEL_INPUTS * KERNEL_PASSES;
+
+    run(name + "/diff_bit/loop", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                int bit = 31;
+                while (((keys[i] ^ others[i]) >> bit & 1) == 0) {
+                    --bit;
+                }
+                sum += bit;
+            }
+        }
+        blackhole += sum;
+    });
+    run(name + "/diff_bit/clz", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                sum += 31 - KeyTraits<uint32_t>::clz(keys[i] ^ others[i]);
+            }
+        }
+        blackhole += sum;
+    });
+
+    run(name + "/netmask/shift", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                sum += keys[i] & netmask(masks[i]);
+            }
+        }
+        blackhole += sum;
+    });
+    run(name + "/netmask/table", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                sum += keys[i] & ::netmask<uint32_t>(masks[i]);
+            }
+        }
+        blackhole += sum;
+    });
+
+    run(name + "/max_prefix/scan", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                int found = -1;
+                for (size_t p = 0; p < sorted[i].size(); ++p) {
+                    if (((others[i] ^ keys[i]) & netmask(sorted[i][p])) == 0) {
+                        found = sorted[i][p];
+                        break;
+                    }
+                }
+                sum += found;
+            }
+        }
+        blackhole += sum;
+    });
+    run(name + "/max_prefix/bitmap", ops, []() {}, [&]() {
+        unsigned sum = 0;
+        for (size_t pass = 0; pass < KERNEL_PASSES; ++pass) {
+            for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+                sum += nodes[i].getMaxPrefixForIp(others[i]);
+            }
+        }
+        blackhole += sum;
+    });
+
+    // One prefix added to each base, on a copy made before the timing
+    std::vector<std::vector<char> > sortedCopy;
+    std::vector<DataNode> nodesCopy;
+    run(name + "/add_prefix/insert", ops / KERNEL_PASSES, [&]() { sortedCopy = sorted; }, [&]() {
+        for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+            std::vector<char>& prefixes = sortedCopy[i];
+            prefixes.push_back(masks[i]);
+            for (size_t p = prefixes.size() - 1; p > 0 && prefixes[p - 1] < prefixes[p]; --p) {
+                std::swap(prefixes[p - 1], prefixes[p]);
+            }
+        }
+    });
+    run(name + "/add_prefix/bitmap", ops / KERNEL_PASSES, [&]() { nodesCopy = nodes; }, [&]() {
+        for (size_t i = 0; i < KERNEL_INPUTS; ++i) {
+            nodesCopy[i].addPrefix(std::max<char>(masks[i], 1));
+        }
+    });
+
+}
+
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strncmp(argv[i], "--repetitions=", 14) == 0) {
+            repetitions = std::max(1, atoi(argv[i] + 14));
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else {
+            cerr << "usage: " << argv[0] << " [--json] [--repetitions=N] [--filter=substring]" << endl;
+            return 1;
+        }
+    }
+
+    if (benchTable("route", routeMask) != 0 || benchTable("uniform", uniformMask) != 0) {
+        return 1;
+    }
+    benchIp6();
+
+    benchChurn<CompactingPolicy>("route/churn_compacting");
+    benchChurn<FreeListPolicy>("route/churn_free_list");
+    benchBurst();
+    benchSharded();
+    benchMap();
+    benchArena();
+    benchAddLatency();
+    benchMultiTable();
+    benchKernels();
+
+    for (size_t readers = 1; readers <= 4; readers *= 2) {
+        benchConcurrent(readers);
+    }
+
+    // A typo in the filter must not pass as a run that compared nothing
+    if (results.empty()) {
+        cerr << argv[0] << ": no benchmark matches --filter=" << filter << endl;
+        return 1;
+    }
+    if (json) {
+        printJson();
+    }
+    return 0;
+}
@@ -27,11 +27,22 @@
 #include <cassert>
 #include <functional>
 #include <stdexcept>
+#include <random>
+#include <memory>
+#include <set>
+#include <thread>
+#include <atomic>
     
 
 #include <arpa/inet.h>
 
 #include "IpContainer.hpp"
+#include "IpSnapshot.hpp"
+#include "ConcurrentIpContainer.hpp"
+#include "IpLookupCache.hpp"
+#include "ShardedIpContainer.hpp"
+#include "IpMap.hpp"
+#include "MultiIpContainer.hpp"
 
 class IpContainerTest : public IpContainer {
 
@@ -78,23 +89,20 @@ char IpContainerTest::check(const std::string& ip)
 
 void IpContainerTest::list(pointer node, list_visitor_type& visitor)
 {
-    if (node->isInner()) {
-        assert(node->inner.zero->getParent() == node);
-        assert(node->inner.one->getParent() == node);
-
-        list(node->inner.zero, visitor);
-        list(node->inner.one, visitor);
+    if (at(node).isInner()) {
+        list(at(node).inner.zero, visitor);
+        list(at(node).inner.one, visitor);
     } else {
-        visitor(*node->leaf.data);
+        visitor(at(node).leaf.data);
     }
 }
 
 void IpContainerTest::list(list_visitor_type& visitor)
 {
-    if (root->root.child == pointer()) {
+    if (at(root).root.child == pointer()) {
         return; 
     } 
-    list(root->root.child, visitor);
+    list(at(root).root.child, visitor);
 }
 
 unsigned int IpContainerTest::getBase(const std::string& ip)
@@ -145,8 +153,12 @@ std::function<void(const IpContainerTest::data_type&)> printVisitor = [](const I
                 << "." << ((data.ip & (0x00FF0000)) >> 16) 
                 << "." << ((data.ip & (0x0000FF00)) >>  8)
                 << "." << ((data.ip & (0x000000FF)) >>  0) << ": ";
-    for (int i = 0; i < data.prefixes.size(); ++i) {
-        cerr << (i != 0 ? ", " : "") << (unsigned)data.prefixes[i];
+    const char* separator = "";
+    for (char prefix = 1; prefix <= 32; ++prefix) {
+        if (data.contain(prefix)) {
+            cerr << separator << (unsigned)prefix;
+            separator = ", ";
+        }
     }
     cerr << ";" << endl;
 };   
@@ -222,6 +234,1479 @@ void test_del()
     CHECK_EQUAL(container.check("0.0.0.130"), -1);
 }
 
+void test_default_route()
+{
+    IpContainerTest container;
+    container.add("0.0.0.0", 0);
+    CHECK_EQUAL(container.check("1.2.3.4"), 0);
+    container.add("10.0.0.0", 8);
+    CHECK_EQUAL(container.check("10.1.1.1"), 8);
+    CHECK_EQUAL(container.check("11.1.1.1"), 0);
+
+    IpSnapshot snapshot;
+    snapshot.compile(container);
+    CHECK_EQUAL(snapshot.check(0x0b010101), 0);
+    CHECK_EQUAL(snapshot.check(0x0a010101), 8);
+
+    REQUIRE_THROW(container.del("1.0.0.0", 0));
+    container.del("0.0.0.0", 0);
+    CHECK_EQUAL(container.check("11.1.1.1"), -1);
+    REQUIRE_THROW(container.del("0.0.0.0", 0));
+
+    // A base that is not stored must not remove the leaf it lands on
+    REQUIRE_THROW(container.del("10.1.0.0", 8));
+    CHECK_EQUAL(container.check("10.1.1.1"), 8);
+}
+
+void test_check_batch()
+{
+    IpContainerTest container;
+    std::mt19937 rng(42);
+    for (int i = 0; i < 2000; ++i) {
+        char mask = 8 + rng() % 23;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        container.IpContainer::add(base, mask);
+    }
+
+    std::vector<uint32_t> ips(5000);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = rng();
+    }
+    std::vector<char> results(ips.size());
+    container.checkBatch(ips.data(), results.data(), ips.size());
+
+    int mismatches = 0;
+    int hits = 0;
+    for (size_t i = 0; i < ips.size(); ++i) {
+        char expected = container.IpContainer::check(ips[i]);
+        mismatches += results[i] != expected;
+        hits += expected != -1;
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(hits > 0, true);
+
+    container.checkBatch(ips.data(), results.data(), 3);
+    CHECK_EQUAL(results[2], container.IpContainer::check(ips[2]));
+
+    IpContainerTest empty;
+    empty.checkBatch(ips.data(), results.data(), ips.size());
+    CHECK_EQUAL(std::count(results.begin(), results.end(), -1), ips.size());
+}
+
+void test_snapshot()
+{
+    IpContainerTest container;
+    IpSnapshot snapshot;
+    snapshot.compile(container);
+    CHECK_EQUAL(snapshot.check(0x0a000001), -1);
+
+    std::mt19937 rng(7);
+    std::vector<uint32_t> bases;
+    for (int i = 0; i < 2000; ++i) {
+        char mask = 8 + rng() % 23;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (container.IpContainer::add(base, mask) == 0) {
+            bases.push_back(base);
+        }
+    }
+    container.add("10.0.0.0", 8);
+    container.add("10.1.2.0", 24);
+    container.add("10.1.2.128", 30);
+    snapshot.compile(container);
+
+    int mismatches = 0;
+    for (int i = 0; i < 100000; ++i) {
+        uint32_t ip = rng();
+        if (i % 2) {
+            ip = bases[rng() % bases.size()] | (ip & 0x3ff);
+        }
+        mismatches += snapshot.check(ip) != container.IpContainer::check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(snapshot.check(0x0a010282), container.check("10.1.2.130"));
+    CHECK_EQUAL(snapshot.check(0x0a010205), container.check("10.1.2.5"));
+    CHECK_EQUAL(snapshot.memoryUsage() > (1 << 16) * sizeof(uint32_t), true);
+
+    container.del("10.1.2.128", 30);
+    snapshot.compile(container);
+    CHECK_EQUAL(snapshot.check(0x0a010282), container.check("10.1.2.130"));
+}
+
+void test_snapshot_batch()
+{
+    IpContainerTest container;
+    std::mt19937 rng(14);
+    std::vector<uint32_t> bases;
+    for (int i = 0; i < 5000; ++i) {
+        char mask = 1 + rng() % 32;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (container.IpContainer::add(base, mask) == 0) {
+            bases.push_back(base);
+        }
+    }
+    IpSnapshot snapshot;
+    snapshot.compile(container);
+
+    // Lengths that leave a tail behind every vector width
+    std::vector<uint32_t> ips(4099);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = rng();
+        if (i % 2) {
+            ips[i] = bases[rng() % bases.size()] | (ips[i] & 0x3ff);
+        }
+    }
+    std::vector<char> expected(ips.size());
+    for (size_t i = 0; i < ips.size(); ++i) {
+        expected[i] = container.IpContainer::check(ips[i]);
+    }
+
+    IpSnapshot::Kernel kernels[] = {IpSnapshot::KERNEL_AUTO, IpSnapshot::KERNEL_SCALAR,
+                                    IpSnapshot::KERNEL_AVX2, IpSnapshot::KERNEL_AVX512};
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!IpSnapshot::supports(kernels[k])) {
+            cerr << "kernel " << kernels[k] << " not supported, checked through the scalar fallback" << endl;
+        }
+        size_t lengths[] = {0, 1, 7, 8, 15, 16, 17, 256, ips.size()};
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+            std::vector<char> out(lengths[l] + 1, 42);
+            snapshot.checkBatch(ips.data(), out.data(), lengths[l], kernels[k]);
+            CHECK_EQUAL(std::equal(out.begin(), out.end() - 1, expected.begin()), true);
+            CHECK_EQUAL(out[lengths[l]], 42);
+        }
+    }
+    CHECK_EQUAL(snapshot.kernel() != IpSnapshot::KERNEL_AUTO, true);
+    CHECK_EQUAL(IpSnapshot::supports(snapshot.kernel()), true);
+
+    // Only refreshed, as the snapshots of a ConcurrentIpContainer are
+    IpSnapshot refreshed;
+    CHECK_EQUAL(refreshed.kernel(), IpSnapshot::KERNEL_AUTO);
+    refreshed.refresh(container, bases[0], 24);
+    CHECK_EQUAL(refreshed.kernel() != IpSnapshot::KERNEL_AUTO, true);
+}
+
+void test_stats()
+{
+    IpContainer container;
+    container.add(0x0a000000, 8);
+    container.add(0x0a010000, 16);
+    container.add(0x0a010200, 24);
+    container.add(0xc0a80000, 16);
+    // Frees nodes below the tail of the arena, compaction moves others
+    container.del(0x0a010000, 16);
+    CHECK_EQUAL(container.del(0x0a010000, 16), -1);
+    container.check(0x0a010203);
+    container.check(0x0b000000);
+    uint32_t ips[] = {0x0a000001, 0x0a010001, 0x0a010201, 0x7f000001};
+    char out[4];
+    container.checkBatch(ips, out, 4);
+
+    IpContainerStats stats = container.stats();
+#ifdef IPCONTAINER_STATS
+    CHECK_EQUAL(stats.adds, 4);
+    CHECK_EQUAL(stats.dels, 1);
+    CHECK_EQUAL(stats.lookups, 6);
+    CHECK_EQUAL(stats.hits, 4);
+    CHECK_EQUAL(stats.misses, 2);
+    uint64_t walks = 0;
+    uint64_t passed = 0;
+    for (int d = 0; d <= IpContainerStats::MAX_DEPTH; ++d) {
+        walks += stats.depths[d];
+        passed += stats.depths[d] * d;
+    }
+    CHECK_EQUAL(walks, stats.lookups);
+    CHECK_EQUAL(stats.lookupNodes, passed + walks);
+    CHECK_EQUAL(stats.updateNodes > 0, true);
+    CHECK_EQUAL(stats.chunkMoves > 0, true);
+
+    // Enough nodes to outgrow the initial buffer
+    for (uint32_t i = 0; i < 64; ++i) {
+        container.add(0x20000000 | (i << 8), 24);
+    }
+    CHECK_EQUAL(container.stats().reallocs > stats.reallocs, true);
+    CHECK_EQUAL(container.stats().bytesMoved >= stats.bytesMoved, true);
+#else
+    CHECK_EQUAL(stats.lookups, 0);
+    CHECK_EQUAL(stats.adds, 0);
+    CHECK_EQUAL(stats.reallocs, 0);
+#endif
+}
+
+void test_independent_containers()
+{
+    typedef std::set<std::pair<uint32_t, char> > model_type;
+    const int TABLES = 6;
+
+    std::vector<std::unique_ptr<IpContainer> > tables;
+    std::vector<model_type> models(TABLES);
+    for (int t = 0; t < TABLES; ++t) {
+        tables.push_back(std::unique_ptr<IpContainer>(new IpContainer()));
+    }
+
+    std::mt19937 rng(3);
+    for (int i = 0; i < 20000; ++i) {
+        int t = rng() % TABLES;
+        char mask = 16 + rng() % 9;
+        uint32_t base = rng() & 0xffff0000 & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (rng() % 3 == 0 && !models[t].empty()) {
+            model_type::iterator it = models[t].begin();
+            std::advance(it, rng() % models[t].size());
+            tables[t]->del(it->first, it->second);
+            models[t].erase(it);
+        } else if (tables[t]->add(base, mask) == 0) {
+            models[t].insert(std::make_pair(base, mask));
+        }
+    }
+    // Freeing a table must not disturb the others
+    tables[2].reset();
+
+    int mismatches = 0;
+    for (int t = 0; t < TABLES; ++t) {
+        if (!tables[t]) {
+            continue;
+        }
+        IpContainer reference;
+        for (model_type::iterator it = models[t].begin(); it != models[t].end(); ++it) {
+            reference.add(it->first, it->second);
+        }
+        for (int i = 0; i < 20000; ++i) {
+            uint32_t ip = rng();
+            mismatches += tables[t]->check(ip) != reference.check(ip);
+        }
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+void test_concurrent_readers()
+{
+    const int READERS = 3;
+    const uint32_t GENERATIONS = 40;
+
+    // Every publish adds (and later removes) the pair 10.g.0.0/16 and
+    // 20.g.0.0/16, so a consistent view sees both or neither of them
+    ConcurrentIpContainer container;
+    container.add(0x01000000, 8);
+    container.publish();
+
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+    std::atomic<int> lookups(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; ++r) {
+        readers.push_back(std::thread([&container, &done, &torn, &lookups, r]() {
+            ConcurrentIpContainer::Reader reader = container.reader();
+            std::mt19937 rng(r);
+            while (!done.load()) {
+                uint32_t g = rng() % GENERATIONS;
+                uint32_t ips[3] = {0x0a000101 | (g << 16), 0x14000101 | (g << 16), 0x01020304};
+                char out[3];
+                reader.checkBatch(ips, out, 3);
+                if (out[0] != out[1] || out[2] != 8) {
+                    ++torn;
+                }
+                reader.check(ips[0]);
+                ++lookups;
+            }
+        }));
+    }
+    // Publishing is quick enough to be over before the readers get going
+    while (lookups.load() < READERS) {
+        std::this_thread::yield();
+    }
+
+    for (uint32_t g = 0; g < GENERATIONS; ++g) {
+        container.add(0x0a000000 | (g << 16), 16);
+        container.add(0x14000000 | (g << 16), 16);
+        container.publish();
+    }
+    for (uint32_t g = 0; g < GENERATIONS; g += 2) {
+        container.del(0x0a000000 | (g << 16), 16);
+        container.del(0x14000000 | (g << 16), 16);
+        container.publish();
+    }
+    done.store(true);
+    for (size_t r = 0; r < readers.size(); ++r) {
+        readers[r].join();
+    }
+
+    CHECK_EQUAL(torn.load(), 0);
+    CHECK_EQUAL(lookups.load() > 0, true);
+
+    ConcurrentIpContainer::Reader reader = container.reader();
+    CHECK_EQUAL(reader.check(0x0a010101), 16);
+    CHECK_EQUAL(reader.check(0x14020101), -1);
+
+    ConcurrentIpContainer small(1);
+    ConcurrentIpContainer::Reader first = small.reader();
+    REQUIRE_THROW(small.reader());
+}
+
+void test_free_list_policy()
+{
+    ChunkBuff<uint32_t, uint32_t, FreeListPolicy> buff;
+    int owner = 0;
+    std::vector<uint32_t> slots;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        slots.push_back(buff.allocate());
+        buff[slots.back()] = i;
+    }
+    for (uint32_t i = 0; i < 1000; i += 2) {
+        buff.deallocate(slots[i], owner);
+    }
+    int reused = 0;
+    for (uint32_t i = 0; i < 500; ++i) {
+        uint32_t slot = buff.allocate();
+        reused += slot <= slots.back();
+        buff[slot] = 1000 + i;
+    }
+    CHECK_EQUAL(reused, 500);
+    int moved = 0;
+    for (uint32_t i = 1; i < 1000; i += 2) {
+        moved += buff[slots[i]] != i;
+    }
+    CHECK_EQUAL(moved, 0);
+
+    for (uint32_t slot = 1; slot <= slots.back(); ++slot) {
+        buff.deallocate(slot, owner);
+    }
+    // An empty buffer starts over from the first slot
+    CHECK_EQUAL(buff.allocate(), 1);
+
+    BasicIpContainer<FreeListPolicy> stable;
+    IpContainer compacting;
+    std::mt19937 rng(5);
+    std::vector<std::pair<uint32_t, char> > routes;
+    int mismatches = 0;
+    for (int i = 0; i < 30000; ++i) {
+        if (routes.size() > 500 && rng() % 2) {
+            size_t r = rng() % routes.size();
+            int ret = stable.del(routes[r].first, routes[r].second);
+            mismatches += ret != compacting.del(routes[r].first, routes[r].second);
+            routes[r] = routes.back();
+            routes.pop_back();
+            continue;
+        }
+        char mask = 16 + rng() % 9;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (compacting.check(base) != mask) {
+            routes.push_back(std::make_pair(base, mask));
+        }
+        stable.add(base, mask);
+        compacting.add(base, mask);
+    }
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += stable.check(ip) != compacting.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+void test_longest_prefix_match()
+{
+    IpContainerTest container;
+    container.add("10.0.0.0", 8);
+    container.add("10.1.2.0", 24);
+    CHECK_EQUAL(container.check("10.1.5.5"), 8);
+    CHECK_EQUAL(container.check("10.1.2.5"), 24);
+    container.add("10.1.0.0", 16);
+    CHECK_EQUAL(container.check("10.1.5.5"), 16);
+    container.del("10.1.0.0", 16);
+    CHECK_EQUAL(container.check("10.1.5.5"), 8);
+
+    // Compare against a brute force search over every stored prefix
+    typedef std::set<std::pair<uint32_t, char> > model_type;
+    model_type model;
+    BasicIpContainer<FreeListPolicy> table;
+    IpSnapshot compiled;
+    IpSnapshot refreshed;
+    refreshed.compile(table);
+    std::mt19937 rng(11);
+    for (int i = 0; i < 3000; ++i) {
+        if (i % 4 == 3 && !model.empty()) {
+            model_type::iterator it = model.begin();
+            std::advance(it, rng() % model.size());
+            table.del(it->first, it->second);
+            refreshed.refresh(table, it->first, it->second);
+            model.erase(it);
+            continue;
+        }
+        // Few distinct bases, so prefixes nest a lot
+        char mask = 1 + rng() % 32;
+        uint32_t base = (rng() & 0x7f0f0f0f) & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (table.add(base, mask) == 0) {
+            refreshed.refresh(table, base, mask);
+            model.insert(std::make_pair(base, mask));
+        }
+    }
+    compiled.compile(table);
+
+    std::vector<uint32_t> ips(20000);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = rng() & 0x7f0f0f0f;
+    }
+    std::vector<char> results(ips.size());
+    table.checkBatch(ips.data(), results.data(), ips.size());
+
+    int mismatches = 0;
+    int hits = 0;
+    for (size_t i = 0; i < ips.size(); ++i) {
+        char expected = -1;
+        for (model_type::iterator it = model.begin(); it != model.end(); ++it) {
+            uint32_t netmask = static_cast<uint32_t>(-1) << (32 - it->second);
+            if (((ips[i] ^ it->first) & netmask) == 0) {
+                expected = std::max(expected, it->second);
+            }
+        }
+        hits += expected != -1;
+        mismatches += table.check(ips[i]) != expected;
+        mismatches += results[i] != expected;
+        mismatches += compiled.check(ips[i]) != expected;
+        mismatches += refreshed.check(ips[i]) != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(hits > 0, true);
+}
+
+void test_bulk_load()
+{
+    std::mt19937 rng(17);
+    std::vector<IpContainer::route_type> routes;
+    for (int i = 0; i < 20000; ++i) {
+        char mask = 8 + rng() % 25;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        routes.push_back(std::make_pair(base, mask));
+    }
+    routes.push_back(std::make_pair(0x0a000000, 8));
+    routes.push_back(std::make_pair(0x0a000000, 16));
+    routes.push_back(std::make_pair(0x0a000000, 24));
+    routes.push_back(std::make_pair(0, 0));
+
+    IpContainer reference;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        reference.add(routes[i].first, routes[i].second);
+    }
+    BasicIpContainer<FreeListPolicy> loaded;
+    CHECK_EQUAL(loaded.bulkLoad(routes.begin(), routes.end()), 0);
+    std::sort(routes.begin(), routes.end());
+    IpContainer sorted;
+    CHECK_EQUAL(sorted.bulkLoad(routes.begin(), routes.end()), 0);
+
+    int mismatches = 0;
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = i % 2 ? rng() : routes[rng() % routes.size()].first | (rng() & 0xff);
+        char expected = reference.check(ip);
+        mismatches += loaded.check(ip) != expected;
+        mismatches += sorted.check(ip) != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // The loaded trie takes updates like one built by add()
+    CHECK_EQUAL(sorted.check(0x0a000001), 24);
+    CHECK_EQUAL(sorted.del(0x0a000000, 24), 0);
+    CHECK_EQUAL(reference.del(0x0a000000, 24), 0);
+    CHECK_EQUAL(sorted.check(0x0a000001), reference.check(0x0a000001));
+    for (size_t i = 0; i < routes.size(); i += 2) {
+        sorted.del(routes[i].first, routes[i].second);
+        reference.del(routes[i].first, routes[i].second);
+    }
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += sorted.check(ip) != reference.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // Invalid routes are rejected as a whole, other containers get add()
+    IpContainer rejected;
+    IpContainer::route_type invalid[] = {std::make_pair(0x0a000000, 8), std::make_pair(0x0a000001, 8)};
+    CHECK_EQUAL(rejected.bulkLoad(invalid, invalid + 2), -1);
+    CHECK_EQUAL(rejected.check(0x0a000001), -1);
+    CHECK_EQUAL(rejected.bulkLoad(invalid, invalid + 1), 0);
+    CHECK_EQUAL(rejected.bulkLoad(routes.begin(), routes.begin() + 100), 0);
+    CHECK_EQUAL(rejected.check(0x0a000001), 8);
+    CHECK_EQUAL(rejected.check(routes[99].first), reference.check(routes[99].first));
+}
+
+unsigned __int128 getBase6(const std::string& ip)
+{
+    unsigned char binip[16];
+    inet_pton(AF_INET6, ip.c_str(), &binip);
+
+    unsigned __int128 ret = 0;
+    for (int i = 0; i < 16; ++i) {
+        ret <<= 8;
+        ret |= binip[i];
+    }
+    return ret;
+}
+
+void test_ipv6()
+{
+    Ip6Container container;
+    CHECK_EQUAL(container.check(getBase6("2001:db8::1")), -1);
+    CHECK_EQUAL(container.add(getBase6("2001:db8::"), 32), 0);
+    CHECK_EQUAL(container.add(getBase6("2001:db8:1::"), 48), 0);
+    CHECK_EQUAL(container.add(getBase6("2001:db8:1:2::"), 64), 0);
+    CHECK_EQUAL(container.add(getBase6("2001:db8:1:2::1"), 128), 0);
+    CHECK_EQUAL(container.add(getBase6("2001:db8:1::1"), 48), -1);
+    CHECK_EQUAL(container.add(getBase6("2001:db8::"), 129), -1);
+
+    CHECK_EQUAL(container.check(getBase6("2001:db8:1:2::1")), 128);
+    CHECK_EQUAL(container.check(getBase6("2001:db8:1:2::2")), 64);
+    CHECK_EQUAL(container.check(getBase6("2001:db8:1:3::1")), 48);
+    CHECK_EQUAL(container.check(getBase6("2001:db8:2::1")), 32);
+    CHECK_EQUAL(container.check(getBase6("2001:db9::1")), -1);
+    container.add(0, 0);
+    CHECK_EQUAL(container.check(getBase6("ffff::1")), 0);
+
+    CHECK_EQUAL(container.del(getBase6("2001:db8:1:2::1"), 128), 0);
+    CHECK_EQUAL(container.check(getBase6("2001:db8:1:2::1")), 64);
+    CHECK_EQUAL(container.del(getBase6("2001:db8:1:2::1"), 128), -1);
+
+    // Bases above 2^31 are stored like any other
+    IpContainerTest high;
+    high.add("192.168.0.0", 16);
+    high.add("255.255.255.255", 32);
+    CHECK_EQUAL(high.check("192.168.1.1"), 16);
+    CHECK_EQUAL(high.check("255.255.255.255"), 32);
+    CHECK_EQUAL(high.check("127.0.0.1"), -1);
+
+    // Random /32 to /64 table against a brute force search
+    typedef std::set<std::pair<unsigned __int128, short> > model_type;
+    model_type model;
+    model.insert(std::make_pair(getBase6("2001:db8::"), 32));
+    model.insert(std::make_pair(getBase6("2001:db8:1::"), 48));
+    model.insert(std::make_pair(getBase6("2001:db8:1:2::"), 64));
+    std::mt19937_64 rng(13);
+    unsigned __int128 site = getBase6("2001:db8::");
+    for (int i = 0; i < 2000; ++i) {
+        short mask = 32 + rng() % 33;
+        unsigned __int128 base = site | (static_cast<unsigned __int128>(rng() & 0x00000f0f0f0f) << 64);
+        base &= ~((static_cast<unsigned __int128>(1) << (128 - mask)) - 1);
+        if (container.add(base, mask) == 0) {
+            model.insert(std::make_pair(base, mask));
+        }
+    }
+    std::vector<unsigned __int128> ips(5000);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = site | (static_cast<unsigned __int128>(rng() & 0x00000f0f0f0f) << 64) | rng();
+    }
+    std::vector<short> results(ips.size());
+    container.checkBatch(ips.data(), results.data(), ips.size());
+
+    int mismatches = 0;
+    for (size_t i = 0; i < ips.size(); ++i) {
+        short expected = 0;
+        for (model_type::iterator it = model.begin(); it != model.end(); ++it) {
+            unsigned __int128 diff = (ips[i] ^ it->first) >> (128 - it->second);
+            if (diff == 0) {
+                expected = std::max(expected, it->second);
+            }
+        }
+        mismatches += container.check(ips[i]) != expected;
+        mismatches += results[i] != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+
+void test_save_open()
+{
+    const std::string path = "/tmp/IpContainerTest.bin";
+    std::mt19937 rng(19);
+    IpContainer container;
+    for (int i = 0; i < 5000; ++i) {
+        char mask = 8 + rng() % 25;
+        container.add(rng() & (static_cast<uint32_t>(-1) << (32 - mask)), mask);
+    }
+    container.add(0, 0);
+    CHECK_EQUAL(container.save(path), 0);
+
+    IpContainer mapped;
+    CHECK_EQUAL(mapped.open(path), 0);
+    BasicIpContainer<FreeListPolicy> other;
+    CHECK_EQUAL(other.open(path), 0);
+
+    std::vector<uint32_t> ips(20000);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = rng();
+    }
+    std::vector<char> results(ips.size());
+    mapped.checkBatch(ips.data(), results.data(), ips.size());
+    int mismatches = 0;
+    for (size_t i = 0; i < ips.size(); ++i) {
+        char expected = container.check(ips[i]);
+        mismatches += mapped.check(ips[i]) != expected;
+        mismatches += other.check(ips[i]) != expected;
+        mismatches += results[i] != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // A mapped container is read-only
+    CHECK_EQUAL(mapped.add(0x0a000000, 8), -1);
+    CHECK_EQUAL(mapped.del(0, 0), -1);
+    CHECK_EQUAL(mapped.open(path), -1);
+
+    IpContainer full;
+    full.add(0x0a000000, 8);
+    CHECK_EQUAL(full.open(path), -1);
+    IpContainer missing;
+    CHECK_EQUAL(missing.open(path + ".missing"), -1);
+    CHECK_EQUAL(missing.check(0x0a000001), -1);
+    Ip6Container wrongKey;
+    CHECK_EQUAL(wrongKey.open(path), -1);
+
+    FILE* file = fopen(path.c_str(), "r+b");
+    fputc('X', file);
+    fclose(file);
+    IpContainer corrupt;
+    CHECK_EQUAL(corrupt.open(path), -1);
+
+    // A valid header over links that lead out of the file or in circles.
+    // Slot 1 is the root, its child follows the flag.
+    const long rootChild = 32 + 16 + 4;
+    CHECK_EQUAL(container.save(path), 0);
+    file = fopen(path.c_str(), "r+b");
+    uint32_t child = 0;
+    fseek(file, rootChild, SEEK_SET);
+    CHECK_EQUAL(fread(&child, sizeof(child), 1, file), 1);
+    uint32_t outside = 0x7fffffff;
+    fseek(file, rootChild, SEEK_SET);
+    fwrite(&outside, sizeof(outside), 1, file);
+    fclose(file);
+    IpContainer outsideMapped;
+    CHECK_EQUAL(outsideMapped.open(path), -1);
+    file = fopen(path.c_str(), "r+b");
+    // The root's child is inner, its one link points back to itself
+    fseek(file, rootChild, SEEK_SET);
+    fwrite(&child, sizeof(child), 1, file);
+    fseek(file, 32 + 16 * child + 4, SEEK_SET);
+    fwrite(&child, sizeof(child), 1, file);
+    fclose(file);
+    IpContainer cycleMapped;
+    CHECK_EQUAL(cycleMapped.open(path), -1);
+
+    // Free slots of a free list hold anything, they aren't reached
+    BasicIpContainer<FreeListPolicy> holes;
+    for (int i = 0; i < 5000; ++i) {
+        holes.add(static_cast<uint32_t>(i) << 12, 20);
+    }
+    for (int i = 0; i < 5000; i += 3) {
+        holes.del(static_cast<uint32_t>(i) << 12, 20);
+    }
+    CHECK_EQUAL(holes.save(path), 0);
+    BasicIpContainer<FreeListPolicy> holesMapped;
+    CHECK_EQUAL(holesMapped.open(path), 0);
+    CHECK_EQUAL(holesMapped.check(1 << 12), 20);
+    CHECK_EQUAL(holesMapped.check(3 << 12), -1);
+
+    Ip6Container ip6;
+    ip6.add(getBase6("2001:db8::"), 32);
+    ip6.add(getBase6("2001:db8:1::"), 48);
+    CHECK_EQUAL(ip6.save(path), 0);
+    CHECK_EQUAL(wrongKey.open(path), 0);
+    CHECK_EQUAL(wrongKey.check(getBase6("2001:db8:1::1")), 48);
+    CHECK_EQUAL(wrongKey.check(getBase6("2001:db8:2::1")), 32);
+    remove(path.c_str());
+}
+
+template<class Policy>
+void test_relayout()
+{
+    typedef std::set<std::pair<uint32_t, char> > model_type;
+    std::mt19937 rng(23);
+    BasicIpContainer<Policy> container;
+    IpContainer reference;
+    model_type routes;
+    for (int i = 0; i < 40000; ++i) {
+        if (routes.size() > 1000 && rng() % 3 == 0) {
+            model_type::iterator it = routes.begin();
+            std::advance(it, rng() % routes.size());
+            container.del(it->first, it->second);
+            reference.del(it->first, it->second);
+            routes.erase(it);
+            continue;
+        }
+        char mask = 8 + rng() % 25;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        routes.insert(std::make_pair(base, mask));
+        container.add(base, mask);
+        reference.add(base, mask);
+    }
+    CHECK_EQUAL(container.relayout(), 0);
+
+    int mismatches = 0;
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += container.check(ip) != reference.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // Updates work on the new layout
+    for (model_type::iterator it = routes.begin(); it != routes.end(); ++it) {
+        mismatches += container.del(it->first, it->second) != 0;
+        reference.del(it->first, it->second);
+        if (++it == routes.end()) {
+            break;
+        }
+    }
+    container.add(0x0a000000, 8);
+    reference.add(0x0a000000, 8);
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += container.check(ip) != reference.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    BasicIpContainer<Policy> empty;
+    CHECK_EQUAL(empty.relayout(), 0);
+    CHECK_EQUAL(empty.add(0x0a000000, 8), 0);
+    CHECK_EQUAL(empty.check(0x0a000001), 8);
+}
+
+void test_range_queries()
+{
+    typedef std::pair<uint32_t, char> route_type;
+    typedef std::set<route_type> model_type;
+    std::mt19937 rng(16);
+    IpContainer container;
+    model_type routes;
+    // Nested networks inside 10.0.0.0/12
+    for (int i = 0; i < 3000; ++i) {
+        char mask = 8 + rng() % 25;
+        uint32_t base = (0x0a000000 | (rng() & 0x000fffff)) & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (container.add(base, mask) == 0) {
+            routes.insert(route_type(base, mask));
+        }
+    }
+    container.add(0, 0);
+    routes.insert(route_type(0, 0));
+
+    std::vector<route_type> found;
+    auto collect = [&found](uint32_t base, char mask) { found.push_back(route_type(base, mask)); };
+    int mismatches = 0;
+    for (int i = 0; i < 2000; ++i) {
+        uint32_t ip = 0x0a000000 | (rng() & 0x001fffff);
+        std::vector<route_type> expected;
+        for (int mask = 0; mask <= 32; ++mask) {
+            uint32_t base = mask == 0 ? 0 : ip & (static_cast<uint32_t>(-1) << (32 - mask));
+            if (routes.count(route_type(base, mask))) {
+                expected.push_back(route_type(base, mask));
+            }
+        }
+        found.clear();
+        container.forEachCovering(ip, collect);
+        mismatches += found != expected;
+        mismatches += found.empty() ? 0 : found.back().second != container.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    for (int i = 0; i < 2000; ++i) {
+        char mask = rng() % 33;
+        uint32_t base = (0x0a000000 | (rng() & 0x001fffff)) & (mask == 0 ? 0 : static_cast<uint32_t>(-1) << (32 - mask));
+        std::vector<route_type> expected;
+        for (model_type::iterator it = routes.begin(); it != routes.end(); ++it) {
+            uint32_t network = mask == 0 ? 0 : it->first & (static_cast<uint32_t>(-1) << (32 - mask));
+            if (it->second >= mask && network == base) {
+                expected.push_back(*it);
+            }
+        }
+        found.clear();
+        container.forEachWithin(base, mask, collect);
+        mismatches += found != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    found.clear();
+    container.forEachWithin(0, 0, collect);
+    CHECK_EQUAL(found.size(), routes.size());
+    found.clear();
+    container.forEachWithin(0x0b000000, 8, collect);
+    CHECK_EQUAL(found.size(), 0);
+
+    IpContainer empty;
+    found.clear();
+    empty.forEachCovering(0x0a000001, collect);
+    empty.forEachWithin(0, 0, collect);
+    CHECK_EQUAL(found.size(), 0);
+
+    Ip6Container container6;
+    container6.add(getBase6("2001:db8::"), 32);
+    container6.add(getBase6("2001:db8:1::"), 48);
+    container6.add(getBase6("2001:db8:1:2::1"), 128);
+    container6.add(getBase6("2001:db9::"), 32);
+    std::vector<short> masks;
+    auto collectMask = [&masks](unsigned __int128, short mask) { masks.push_back(mask); };
+    container6.forEachCovering(getBase6("2001:db8:1:2::1"), collectMask);
+    CHECK_EQUAL(masks.size(), 3);
+    CHECK_EQUAL(masks.back(), 128);
+    masks.clear();
+    container6.forEachWithin(getBase6("2001:db8::"), 32, collectMask);
+    CHECK_EQUAL(masks.size(), 3);
+}
+
+void test_iterator()
+{
+    typedef std::pair<uint32_t, char> route_type;
+    typedef std::set<route_type> model_type;
+    IpContainer empty;
+    CHECK_EQUAL(empty.begin() == empty.end(), true);
+    CHECK_EQUAL(empty.lower_bound(0x0a000000) == empty.end(), true);
+    empty.add(0, 0);
+    CHECK_EQUAL(std::distance(empty.begin(), empty.end()), 1);
+    CHECK_EQUAL(empty.begin()->second, 0);
+
+    std::mt19937 rng(17);
+    IpContainer container;
+    model_type routes;
+    for (int i = 0; i < 20000; ++i) {
+        char mask = 1 + rng() % 32;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        if (container.add(base, mask) == 0) {
+            routes.insert(route_type(base, mask));
+        }
+    }
+    std::vector<route_type> listed(container.begin(), container.end());
+    CHECK_EQUAL(listed == std::vector<route_type>(routes.begin(), routes.end()), true);
+
+    container.add(0, 0);
+    routes.insert(route_type(0, 0));
+    listed.clear();
+    for (IpContainer::const_iterator it = container.begin(); it != container.end(); it++) {
+        listed.push_back(*it);
+    }
+    CHECK_EQUAL(listed == std::vector<route_type>(routes.begin(), routes.end()), true);
+
+    int mismatches = 0;
+    for (int i = 0; i < 5000; ++i) {
+        uint32_t ip = rng();
+        if (i % 3 == 0) {
+            model_type::iterator it = routes.begin();
+            std::advance(it, rng() % routes.size());
+            ip = it->first + (i % 2);
+        }
+        model_type::iterator expected = routes.lower_bound(route_type(ip, 0));
+        IpContainer::const_iterator found = container.lower_bound(ip);
+        if (expected == routes.end()) {
+            mismatches += found != container.end();
+        } else {
+            mismatches += found == container.end() || *found != *expected;
+            // Iteration goes on from there
+            if (++expected != routes.end() && found != container.end()) {
+                mismatches += *++found != *expected;
+            }
+        }
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(container.lower_bound(0xffffffff) == container.end(), true);
+    CHECK_EQUAL(*container.lower_bound(0) == route_type(0, 0), true);
+
+    Ip6Container container6;
+    container6.add(getBase6("2001:db8:1::"), 48);
+    container6.add(getBase6("2001:db8::"), 32);
+    container6.add(getBase6("2001:db8::"), 48);
+    Ip6Container::const_iterator it6 = container6.begin();
+    CHECK_EQUAL(it6->second, 32);
+    CHECK_EQUAL((++it6)->second, 48);
+    CHECK_EQUAL((++it6)->first == getBase6("2001:db8:1::"), true);
+    CHECK_EQUAL(++it6 == container6.end(), true);
+    CHECK_EQUAL(container6.lower_bound(getBase6("2001:db8::1"))->first == getBase6("2001:db8:1::"), true);
+}
+
+void test_update_batch()
+{
+    typedef std::pair<uint32_t, char> route_type;
+    typedef std::set<route_type> model_type;
+    std::mt19937 rng(18);
+    IpContainer container;
+    IpContainer reference;
+    // Stable slots, the shared walks see no nodes move
+    BasicIpContainer<FreeListPolicy> freeList;
+    model_type routes;
+
+    // The first batch goes into an empty container in one pass
+    UpdateBatch batch;
+    for (int round = 0; round < 20; ++round) {
+        batch.clear();
+        for (int i = 0; i < 2000; ++i) {
+            char mask = 8 + rng() % 25;
+            uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+            if (round > 0 && rng() % 3 == 0 && !routes.empty()) {
+                model_type::iterator it = routes.begin();
+                std::advance(it, rng() % routes.size());
+                base = it->first;
+                mask = it->second;
+            }
+            if (round > 0 && rng() % 2 == 0) {
+                batch.del(base, mask);
+                reference.del(base, mask);
+                routes.erase(route_type(base, mask));
+            } else {
+                batch.add(base, mask);
+                reference.add(base, mask);
+                routes.insert(route_type(base, mask));
+            }
+        }
+        if (round == 10) {
+            batch.add(0, 0);
+            reference.add(0, 0);
+            routes.insert(route_type(0, 0));
+        }
+        CHECK_EQUAL(container.apply(batch), 0);
+        CHECK_EQUAL(freeList.apply(batch), 0);
+    }
+    std::vector<route_type> listed(container.begin(), container.end());
+    CHECK_EQUAL(listed == std::vector<route_type>(routes.begin(), routes.end()), true);
+    std::vector<route_type> listedFreeList(freeList.begin(), freeList.end());
+    CHECK_EQUAL(listedFreeList == listed, true);
+    int mismatches = 0;
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += container.check(ip) != reference.check(ip);
+        mismatches += freeList.check(ip) != reference.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // The last update of a route wins
+    batch.clear();
+    batch.add(0x4b000000, 8);
+    batch.del(0x4b000000, 8);
+    batch.del(0x4c000000, 8);
+    batch.add(0x4c000000, 8);
+    batch.add(0x4c000000, 16);
+    CHECK_EQUAL(container.apply(batch), 0);
+    CHECK_EQUAL(container.check(0x4b000001), reference.check(0x4b000001));
+    CHECK_EQUAL(container.check(0x4c000001), 16);
+    CHECK_EQUAL(container.check(0x4c010001), 8);
+
+    // Nothing changes when one update is invalid
+    batch.clear();
+    batch.add(0x4d000000, 8);
+    batch.add(0x4d000001, 8);
+    CHECK_EQUAL(container.apply(batch), -1);
+    CHECK_EQUAL(container.check(0x4d000001), reference.check(0x4d000001));
+
+    // Readers see whole batches, also after many incremental publishes
+    ConcurrentIpContainer concurrent;
+    ConcurrentIpContainer::Reader reader = concurrent.reader();
+    IpContainer expected;
+    for (int round = 0; round < 30; ++round) {
+        batch.clear();
+        for (int i = 0; i < 200; ++i) {
+            char mask = 8 + rng() % 25;
+            uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+            if (rng() % 4 == 0) {
+                batch.del(base, mask);
+                expected.del(base, mask);
+            } else {
+                batch.add(base, mask);
+                expected.add(base, mask);
+            }
+        }
+        if (round % 10 == 5) {
+            // A short prefix refreshes a large part of the table
+            batch.add(0x20000000, 4);
+            expected.add(0x20000000, 4);
+        }
+        CHECK_EQUAL(concurrent.apply(batch), 0);
+        // Small batches never compile the whole snapshot
+        CHECK_EQUAL(reader.kernel() != IpSnapshot::KERNEL_AUTO, true);
+        for (int i = 0; i < 2000; ++i) {
+            uint32_t ip = rng();
+            mismatches += reader.check(ip) != expected.check(ip);
+        }
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    Ip6Container container6;
+    BasicUpdateBatch<unsigned __int128> batch6;
+    batch6.add(getBase6("2001:db8::"), 32);
+    batch6.add(getBase6("2001:db8::"), 48);
+    batch6.del(getBase6("2001:db8::"), 48);
+    CHECK_EQUAL(container6.apply(batch6), 0);
+    CHECK_EQUAL(container6.check(getBase6("2001:db8::1")), 32);
+}
+
+void test_lookup_cache()
+{
+    std::mt19937 rng(19);
+    IpContainer container;
+    for (int i = 0; i < 5000; ++i) {
+        char mask = 8 + rng() % 25;
+        container.add(rng() & (static_cast<uint32_t>(-1) << (32 - mask)), mask);
+    }
+    IpLookupCache cache(container, 8);
+    CHECK_EQUAL(cache.hitRate(), 0);
+
+    // More addresses than entries, so entries get replaced
+    std::vector<uint32_t> hot;
+    for (int i = 0; i < 300; ++i) {
+        hot.push_back(rng());
+    }
+    int mismatches = 0;
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t ip = hot[rng() % (i % 3 ? 20 : hot.size())];
+        mismatches += cache.check(ip) != container.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(cache.hits() + cache.misses(), 20000);
+    CHECK_EQUAL(cache.hitRate() > 0.5, true);
+
+    // Every kind of update reaches cached results
+    uint32_t ip = 0x0a0b0c0d;
+    cache.check(ip);
+    CHECK_EQUAL(cache.check(ip), container.check(ip));
+    container.add(0x0a0b0c0c, 31);
+    CHECK_EQUAL(cache.check(ip), 31);
+    container.del(0x0a0b0c0c, 31);
+    CHECK_EQUAL(cache.check(ip), container.check(ip));
+    UpdateBatch batch;
+    batch.add(0x0a0b0c0c, 30);
+    container.apply(batch);
+    CHECK_EQUAL(cache.check(ip), 30);
+    container.add(0, 0);
+    container.del(0x0a0b0c0c, 30);
+    CHECK_EQUAL(cache.check(ip), container.check(ip));
+
+    // Failed updates and relayout() keep the generation
+    uint64_t generation = container.generation();
+    container.del(0x0a0b0c0c, 30);
+    container.add(0x0a0b0c0d, 8);
+    container.relayout();
+    CHECK_EQUAL(container.generation(), generation);
+
+    IpContainer empty;
+    IpLookupCache emptyCache(empty);
+    CHECK_EQUAL(emptyCache.check(ip), -1);
+    std::vector<std::pair<uint32_t, char> > routes(1, std::make_pair(0x0a000000u, static_cast<char>(8)));
+    empty.bulkLoad(routes.begin(), routes.end());
+    CHECK_EQUAL(emptyCache.check(ip), 8);
+}
+
+void test_sharded()
+{
+    std::mt19937 rng(20);
+    ShardedIpContainer sharded(8);
+    IpContainer reference;
+    CHECK_EQUAL(sharded.shardCount(), 256);
+    CHECK_EQUAL(sharded.shardOf(0x0a0b0c0d), 0x0a);
+
+    // Short prefixes span several shards
+    int mismatches = 0;
+    for (int i = 0; i < 20000; ++i) {
+        char mask = 1 + rng() % 32;
+        uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+        mismatches += sharded.add(base, mask) != reference.add(base, mask);
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(sharded.add(0x0a000001, 24), -1);
+    CHECK_EQUAL(sharded.add(0x0a000000, 33), -1);
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng();
+        mismatches += sharded.check(ip) != reference.check(ip);
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // A short prefix goes, the next shorter one or the default route takes over
+    sharded.add(0x40000000, 2);
+    reference.add(0x40000000, 2);
+    sharded.add(0x48000000, 5);
+    reference.add(0x48000000, 5);
+    sharded.del(0x48000000, 5);
+    reference.del(0x48000000, 5);
+    CHECK_EQUAL(sharded.del(0x48000000, 5), -1);
+    sharded.add(0, 0);
+    reference.add(0, 0);
+    sharded.del(0x40000000, 2);
+    reference.del(0x40000000, 2);
+
+    // Batches split over shards, on several threads
+    std::vector<uint32_t> ips(50000);
+    for (int round = 0; round < 4; ++round) {
+        UpdateBatch batch;
+        for (int i = 0; i < 5000; ++i) {
+            char mask = 1 + rng() % 32;
+            uint32_t base = rng() & (static_cast<uint32_t>(-1) << (32 - mask));
+            if (rng() % 3 == 0) {
+                batch.del(base, mask);
+                reference.del(base, mask);
+            } else {
+                batch.add(base, mask);
+                reference.add(base, mask);
+            }
+        }
+        CHECK_EQUAL(sharded.apply(batch, round + 1), 0);
+
+        for (size_t i = 0; i < ips.size(); ++i) {
+            ips[i] = rng();
+        }
+        std::vector<char> out(ips.size());
+        sharded.checkBatch(ips.data(), out.data(), ips.size(), 4 - round);
+        for (size_t i = 0; i < ips.size(); ++i) {
+            mismatches += out[i] != reference.check(ips[i]);
+        }
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    UpdateBatch invalid;
+    invalid.add(0x0b000000, 8);
+    invalid.add(0x0b000001, 8);
+    CHECK_EQUAL(sharded.apply(invalid), -1);
+    CHECK_EQUAL(sharded.check(0x0b000001), reference.check(0x0b000001));
+
+    // Updates to different shards from different threads
+    ShardedIpContainer parallel(4);
+    std::vector<std::thread> writers;
+    for (uint32_t t = 0; t < 4; ++t) {
+        writers.push_back(std::thread([&parallel, t]() {
+            for (uint32_t i = 0; i < 1000; ++i) {
+                parallel.add((t << 28) | (i << 8), 24);
+            }
+        }));
+    }
+    for (size_t t = 0; t < writers.size(); ++t) {
+        writers[t].join();
+    }
+    CHECK_EQUAL(parallel.check(0x30003e7f), 24);
+    CHECK_EQUAL(parallel.check(0x40000001), -1);
+
+    BasicShardedIpContainer<CompactingPolicy, unsigned __int128> sharded6(12);
+    sharded6.add(getBase6("2000::"), 3);
+    sharded6.add(getBase6("2001:db8::"), 32);
+    CHECK_EQUAL(sharded6.check(getBase6("2001:db8::1")), 32);
+    CHECK_EQUAL(sharded6.check(getBase6("2002::1")), 3);
+}
+
+uint32_t routeValue(uint32_t base, char mask)
+{
+    return base * 2654435761u + mask;
+}
+
+template<class Policy>
+void test_ip_map()
+{
+    typedef std::pair<uint32_t, char> route_type;
+    std::mt19937 rng(21);
+    BasicIpMap<uint32_t, Policy> map;
+    IpContainer reference;
+    std::vector<route_type> routes;
+
+    // Several prefixes per base move values around within a leaf
+    for (int i = 0; i < 20000; ++i) {
+        char mask = 1 + rng() % 32;
+        uint32_t base = (rng() & 0x0fffffff) & (static_cast<uint32_t>(-1) << (32 - mask));
+        map.add(base, mask, routeValue(base, mask));
+        reference.add(base, mask);
+        routes.push_back(route_type(base, mask));
+    }
+    for (size_t i = 0; i < routes.size(); i += 3) {
+        map.del(routes[i].first, routes[i].second);
+        reference.del(routes[i].first, routes[i].second);
+    }
+    map.add(0, 0, 7);
+    reference.add(0, 0);
+    map.relayout();
+
+    int mismatches = 0;
+    for (int i = 0; i < 50000; ++i) {
+        uint32_t ip = rng() & 0x1fffffff;
+        uint32_t value = 0;
+        char prefix = map.check(ip, value);
+        mismatches += prefix != reference.check(ip);
+        uint32_t base = prefix == 0 ? 0 : ip & (static_cast<uint32_t>(-1) << (32 - prefix));
+        mismatches += prefix > 0 && value != routeValue(base, prefix);
+        mismatches += prefix == 0 && value != 7;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    uint32_t value = 0;
+    CHECK_EQUAL(map.find(routes[1].first, routes[1].second, value), 0);
+    CHECK_EQUAL(value, routeValue(routes[1].first, routes[1].second));
+    CHECK_EQUAL(map.find(routes[0].first, routes[0].second, value), -1);
+    CHECK_EQUAL(map.add(routes[1].first, routes[1].second, 42), 0);
+    map.find(routes[1].first, routes[1].second, value);
+    CHECK_EQUAL(value, 42);
+
+    // Routes without a value, from add() or a batch, hold zero
+    map.add(0x20000000, 8);
+    UpdateBatch batch;
+    batch.add(0x21000000, 8);
+    batch.add(0x21000000, 16);
+    CHECK_EQUAL(map.apply(batch), 0);
+    CHECK_EQUAL(map.check(0x21000001, value), 16);
+    CHECK_EQUAL(value, 0);
+    CHECK_EQUAL(map.check(0x20000001, value), 8);
+    CHECK_EQUAL(value, 0);
+    map.del(0, 0);
+    map.add(0, 0);
+    CHECK_EQUAL(map.check(0x30000000, value), 0);
+    CHECK_EQUAL(value, 0);
+    CHECK_EQUAL(map.save("/tmp/ipmap.bin"), -1);
+
+    // Empty map, one pass build, IPv6 with a struct value
+    BasicIpMap<uint32_t, Policy> loaded;
+    value = 5;
+    CHECK_EQUAL(loaded.check(0x0a000001, value), -1);
+    CHECK_EQUAL(value, 5);
+    std::vector<route_type> table(routes.begin(), routes.begin() + 100);
+    loaded.bulkLoad(table.begin(), table.end());
+    loaded.add(table[10].first, table[10].second, 11);
+    CHECK_EQUAL(loaded.check(table[10].first, value), reference.check(table[10].first));
+
+    struct NextHop {
+        uint32_t gateway;
+        uint16_t interface;
+    };
+    BasicIpMap<NextHop, Policy, unsigned __int128> map6;
+    NextHop hop = {0x0a000001, 3};
+    map6.add(getBase6("2001:db8::"), 32, hop);
+    hop.interface = 4;
+    map6.add(getBase6("2001:db8:1::"), 48, hop);
+    NextHop found = {0, 0};
+    CHECK_EQUAL(map6.check(getBase6("2001:db8:1::1"), found), 48);
+    CHECK_EQUAL(found.interface, 4);
+    CHECK_EQUAL(map6.check(getBase6("2001:db8:2::1"), found), 32);
+    CHECK_EQUAL(found.interface, 3);
+}
+
+template<class Policy>
+void test_arena()
+{
+    std::mt19937 rng(22);
+    std::vector<std::pair<uint32_t, char> > routes;
+    for (int i = 0; i < 100000; ++i) {
+        char mask = 8 + rng() % 25;
+        routes.push_back(std::make_pair(rng() & (static_cast<uint32_t>(-1) << (32 - mask)), mask));
+    }
+    // The routes that stay
+    IpContainer reference;
+    reference.bulkLoad(routes.begin(), routes.end());
+    for (size_t i = 0; i < routes.size(); i += 2) {
+        reference.del(routes[i].first, routes[i].second);
+    }
+
+    // Huge pages fall back to transparent ones without a reserved pool, an
+    // unknown node to no binding
+    ArenaOptions options[] = {ArenaOptions(ArenaOptions::PAGES_TRANSPARENT),
+                              ArenaOptions(ArenaOptions::PAGES_HUGETLB),
+                              ArenaOptions(ArenaOptions::PAGES_DEFAULT, 0),
+                              ArenaOptions(ArenaOptions::PAGES_TRANSPARENT, 999)};
+    for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); ++o) {
+        BasicIpContainer<Policy> container;
+        container.add(0x0a000000, 8);
+        CHECK_EQUAL(container.arena().pages == ArenaOptions::PAGES_DEFAULT, true);
+        CHECK_EQUAL(container.setArena(options[o]), 0);
+        CHECK_EQUAL(container.check(0x0a000001), 8);
+        container.del(0x0a000000, 8);
+
+        // Grows, shrinks and is laid out again in the same kind of memory
+        for (size_t i = 0; i < routes.size(); ++i) {
+            container.add(routes[i].first, routes[i].second);
+        }
+        container.relayout();
+        for (size_t i = 0; i < routes.size(); i += 2) {
+            container.del(routes[i].first, routes[i].second);
+        }
+        int mismatches = 0;
+        for (size_t i = 1; i < routes.size(); i += 2) {
+            mismatches += container.check(routes[i].first) != reference.check(routes[i].first);
+        }
+        CHECK_EQUAL(mismatches, 0);
+        bool defaultPages = options[o].pages == ArenaOptions::PAGES_DEFAULT;
+        CHECK_EQUAL(container.arena().pages == ArenaOptions::PAGES_DEFAULT, defaultPages);
+        CHECK_EQUAL(container.arena().numaNode == -1 || container.arena().numaNode == options[o].numaNode, true);
+    }
+
+    const std::string path = "/tmp/ipcontainer_test_arena.bin";
+    reference.save(path);
+    IpContainer mapped;
+    mapped.open(path);
+    CHECK_EQUAL(mapped.setArena(options[0]), -1);
+    remove(path.c_str());
+
+    // A mapping the system refuses throws, the old block is left as it was
+    ArenaMemory memory(options[0]);
+    size_t bytes = 4096;
+    char* block = static_cast<char*>(memory.reallocate(0, 0, 0, bytes));
+    block[0] = 42;
+    size_t tooMany = static_cast<size_t>(1) << 60;
+    REQUIRE_THROW(memory.reallocate(block, bytes, bytes, tooMany));
+    CHECK_EQUAL(block[0], 42);
+    memory.release(block, bytes);
+}
+
+template<class Policy>
+void test_segmented_arena()
+{
+    const std::string path = "/tmp/IpContainerSegmented.bin";
+    std::mt19937 rng(23);
+    std::vector<std::pair<uint32_t, char> > routes;
+    for (int i = 0; i < 300000; ++i) {
+        char mask = 8 + rng() % 25;
+        routes.push_back(std::make_pair(rng() & (static_cast<uint32_t>(-1) << (32 - mask)), mask));
+    }
+
+    // Several chunks, grown one by one
+    BasicIpContainer<Policy> container;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        container.add(routes[i].first, routes[i].second);
+    }
+#ifdef IPCONTAINER_STATS
+    // Only the first chunk was copied while it grew, 2 MiB of 16 byte nodes
+    CHECK_EQUAL(container.stats().bytesMoved <= 2 * (1 << 17) * 16, true);
+#endif
+
+    // Saved chunk by chunk, mapped as one block
+    CHECK_EQUAL(container.save(path), 0);
+    BasicIpContainer<Policy> mapped;
+    CHECK_EQUAL(mapped.open(path), 0);
+    remove(path.c_str());
+    std::vector<uint32_t> ips(50000);
+    for (size_t i = 0; i < ips.size(); ++i) {
+        ips[i] = rng();
+    }
+    std::vector<char> expected(ips.size());
+    int mismatches = 0;
+    for (size_t i = 0; i < ips.size(); ++i) {
+        expected[i] = container.check(ips[i]);
+        mismatches += mapped.check(ips[i]) != expected[i];
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // Shrinks back into the first chunk and grows again
+    for (size_t i = 1000; i < routes.size(); ++i) {
+        container.del(routes[i].first, routes[i].second);
+    }
+    for (size_t i = 1000; i < routes.size(); ++i) {
+        container.add(routes[i].first, routes[i].second);
+    }
+    for (size_t i = 0; i < ips.size(); ++i) {
+        mismatches += container.check(ips[i]) != expected[i];
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+// Chunks of 24 byte nodes are 3 MiB, a huge page arena rounds them up to
+// 4 MiB and they have to go back at that size
+template<class Policy>
+void test_rounded_chunks()
+{
+    const uint64_t count = 200000;
+    BasicIpContainer<Policy, uint64_t> container;
+    CHECK_EQUAL(container.setArena(ArenaOptions(ArenaOptions::PAGES_TRANSPARENT)), 0);
+    int mismatches = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        mismatches += container.add(i << 20, 44) != 0;
+    }
+    CHECK_EQUAL(mismatches, 0);
+    for (uint64_t i = 0; i < count; ++i) {
+        mismatches += container.check(i << 20 | 0x12345) != 44;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // Shrunk back, then moved to another arena, the chunks are released
+    for (uint64_t i = 100000; i < count; ++i) {
+        mismatches += container.del(i << 20, 44) != 0;
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(container.setArena(ArenaOptions()), 0);
+    for (uint64_t i = 0; i < count; ++i) {
+        mismatches += container.check(i << 20) != (i < 100000 ? 44 : -1);
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+// The compile-time tables against the shifts they replace, /0 and the full
+// width included
+template<class Key>
+void test_netmask_table()
+{
+    const int bits = KeyTraits<Key>::BITS;
+    int mismatches = 0;
+    for (int mask = 0; mask <= bits; ++mask) {
+        Key expected = mask == 0 ? 0 : static_cast<Key>(-1) << (bits - mask);
+        mismatches += netmask<Key>(mask) != expected;
+        Key upTo = mask == bits ? static_cast<Key>(-1) : (static_cast<Key>(1) << mask) - 1;
+        mismatches += prefixesUpTo<Key>(mask) != upTo;
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
+
+// Per-table references, the tables of one trie may not see each other
+template<class Policy>
+void test_multi_table()
+{
+    const uint32_t tableCount = 300;
+    std::mt19937 rng(25);
+    BasicMultiIpContainer<Policy> tables;
+    std::vector<std::unique_ptr<IpContainer> > references;
+    for (uint32_t t = 0; t < tableCount; ++t) {
+        references.push_back(std::unique_ptr<IpContainer>(new IpContainer()));
+    }
+
+    // Every third table stays empty, the others share bases
+    int mismatches = 0;
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t table = rng() % tableCount / 3 * 3 + 1;
+        if (table >= tableCount) {
+            continue;
+        }
+        char mask = rng() % 33;
+        uint32_t base = (rng() % 64 << 24) & (mask == 0 ? 0 : static_cast<uint32_t>(-1) << (32 - mask));
+        mismatches += tables.add(table, base, mask) != references[table]->add(base, mask);
+    }
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(tables.add(1, 0x0a000001, 24), -1);
+    CHECK_EQUAL(tables.add(1, 0x0a000000, 33), -1);
+    CHECK_EQUAL(tables.add(1, 0x0a000000, -1), -1);
+
+    std::vector<uint32_t> ids(50000);
+    std::vector<uint32_t> ips(ids.size());
+    std::vector<char> out(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i] = rng() % tableCount;
+        ips[i] = rng() % 64 << 24 | (rng() & 0xffffff);
+    }
+    tables.checkBatch(&ids[0], &ips[0], &out[0], ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        char expected = references[ids[i]]->check(ips[i]);
+        mismatches += tables.check(ids[i], ips[i]) != expected;
+        mismatches += out[i] != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+
+    // The default route of a table stays in that table
+    CHECK_EQUAL(tables.check(3, 0x01020304), -1);
+    CHECK_EQUAL(tables.add(3, 0, 0), 0);
+    CHECK_EQUAL(tables.check(3, 0x01020304), 0);
+    CHECK_EQUAL(tables.check(6, 0x01020304), -1);
+    CHECK_EQUAL(tables.add(0xffffffff, 0xffffff00, 24), 0);
+    CHECK_EQUAL(tables.check(0xffffffff, 0xffffff01), 24);
+    CHECK_EQUAL(tables.check(0xfffffffe, 0xffffff01), -1);
+    CHECK_EQUAL(tables.del(3, 0, 0), 0);
+    CHECK_EQUAL(tables.del(3, 0, 0), -1);
+
+    // Routes of a table in order, then all of them gone
+    size_t stored = 0;
+    references[4]->forEachWithin(0, 0, [&](uint32_t, char) { ++stored; });
+    size_t listed = 0;
+    bool ordered = true;
+    std::pair<uint32_t, char> last(0, -1);
+    tables.forEachRoute(4, [&](uint32_t base, char mask) {
+        std::pair<uint32_t, char> route(base, mask);
+        ordered = ordered && last < route;
+        last = route;
+        ++listed;
+    });
+    CHECK_EQUAL(listed, stored);
+    CHECK_EQUAL(ordered, true);
+    CHECK_EQUAL(tables.clear(4), stored);
+    CHECK_EQUAL(tables.clear(4), 0);
+    CHECK_EQUAL(tables.relayout(), 0);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        char expected = ids[i] == 4 ? -1 : references[ids[i]]->check(ips[i]);
+        mismatches += tables.check(ids[i], ips[i]) != expected;
+    }
+    CHECK_EQUAL(mismatches, 0);
+}
 
 int main(int argc, const char** argv)
 {
@@ -231,5 +1716,82 @@ int main(int argc, const char** argv)
     cerr << "\nTest del" << endl;
     test_del();
 
+    cerr << "\nTest default route" << endl;
+    test_default_route();
+
+    cerr << "\nTest check batch" << endl;
+    test_check_batch();
+
+    cerr << "\nTest snapshot" << endl;
+    test_snapshot();
+
+    cerr << "\nTest snapshot batch" << endl;
+    test_snapshot_batch();
+
+    cerr << "\nTest stats" << endl;
+    test_stats();
+
+    cerr << "\nTest independent containers" << endl;
+    test_independent_containers();
+
+    cerr << "\nTest concurrent readers" << endl;
+    test_concurrent_readers();
+
+    cerr << "\nTest free list policy" << endl;
+    test_free_list_policy();
+
+    cerr << "\nTest longest prefix match" << endl;
+    test_longest_prefix_match();
+
+    cerr << "\nTest bulk load" << endl;
+    test_bulk_load();
+
+    cerr << "\nTest IPv6" << endl;
+    test_ipv6();
+
+    cerr << "\nTest save and open" << endl;
+    test_save_open();
+
+    cerr << "\nTest relayout" << endl;
+    test_relayout<CompactingPolicy>();
+    test_relayout<FreeListPolicy>();
+
+    cerr << "\nTest range queries" << endl;
+    test_range_queries();
+
+    cerr << "\nTest iterator" << endl;
+    test_iterator();
+
+    cerr << "\nTest update batch" << endl;
+    test_update_batch();
+
+    cerr << "\nTest lookup cache" << endl;
+    test_lookup_cache();
+
+    cerr << "\nTest sharded container" << endl;
+    test_sharded();
+
+    cerr << "\nTest IP map" << endl;
+    test_ip_map<CompactingPolicy>();
+    test_ip_map<FreeListPolicy>();
+
+    cerr << "\nTest arena" << endl;
+    test_arena<CompactingPolicy>();
+    test_arena<FreeListPolicy>();
+
+    cerr << "\nTest segmented arena" << endl;
+    test_segmented_arena<CompactingPolicy>();
+    test_segmented_arena<FreeListPolicy>();
+    test_rounded_chunks<CompactingPolicy>();
+    test_rounded_chunks<FreeListPolicy>();
+
+    cerr << "\nTest netmask table" << endl;
+    test_netmask_table<uint32_t>();
+    test_netmask_table<unsigned __int128>();
+
+    cerr << "\nTest multi table" << endl;
+    test_multi_table<CompactingPolicy>();
+    test_multi_table<FreeListPolicy>();
+
     return 0;
 }